@@ -0,0 +1,292 @@
+// Benchmarks update_from_repo against generated repositories
+// Build it like main.c and run it from a scratch directory, for example
+//   ./bench --files 2000 --size 65536 --depth 20 --churn 50 --update-files 20 --transport git
+#include "launchpad.h"
+#include <stdio.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+typedef struct bench_config {
+    int files;
+    size_t size;
+    int depth;
+    int churn;
+    int update_files;
+    int threads;
+    int staged;
+    // "file" or "git", ignored when url is set
+    const char* transport;
+    // An existing ssh or http remote serving the generated source repository
+    const char* url;
+    // Applies the memory caps main.c uses with LOW_MEMORY_DEVICE
+    int low_memory;
+} bench_config;
+
+typedef struct bench_result {
+    update_timings timings;
+    double wall;
+    long peak_rss_kb;
+    int error;
+} bench_result;
+
+static void fill_random(char* buf, size_t len, unsigned long long* seed)
+{
+    for (size_t i = 0; i < len; i++) {
+        *seed ^= *seed << 13;
+        *seed ^= *seed >> 7;
+        *seed ^= *seed << 17;
+        buf[i] = (char)(*seed & 0xff);
+    }
+}
+
+// Commits new random content for files [first, first + count) on top of main
+static int commit_files(git_repository* repo, const bench_config* config, int first, int count, unsigned long long* seed)
+{
+    git_commit *parent = NULL;
+    git_tree *parent_tree = NULL, *tree = NULL;
+    git_treebuilder *builder = NULL;
+    git_signature *sig = NULL;
+    git_oid parent_oid, blob_oid, tree_oid, commit_oid;
+    char* buf = (char*)malloc(config->size ? config->size : 1);
+
+    int error = 0;
+    if (git_reference_name_to_id(&parent_oid, repo, "refs/heads/main") == 0) {
+        error = git_commit_lookup(&parent, repo, &parent_oid);
+        if (error == 0) {
+            error = git_commit_tree(&parent_tree, parent);
+        }
+    }
+    if (error == 0) {
+        error = git_treebuilder_new(&builder, repo, parent_tree);
+    }
+    for (int i = 0; error == 0 && i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%06d.bin", (first + i) % config->files);
+        fill_random(buf, config->size, seed);
+        error = git_blob_create_from_buffer(&blob_oid, repo, buf, config->size);
+        if (error == 0) {
+            error = git_treebuilder_insert(NULL, builder, name, &blob_oid, GIT_FILEMODE_BLOB);
+        }
+    }
+    if (error == 0) {
+        error = git_treebuilder_write(&tree_oid, builder);
+    }
+    if (error == 0) {
+        error = git_tree_lookup(&tree, repo, &tree_oid);
+    }
+    if (error == 0) {
+        error = git_signature_now(&sig, "bench", "bench@localhost");
+    }
+    if (error == 0) {
+        const git_commit *parents[1] = {parent};
+        error = git_commit_create(&commit_oid, repo, "refs/heads/main", sig, sig, NULL, "bench", tree, parent ? 1 : 0, parents);
+    }
+
+    free(buf);
+    git_signature_free(sig);
+    git_tree_free(tree);
+    git_treebuilder_free(builder);
+    git_tree_free(parent_tree);
+    git_commit_free(parent);
+    return error;
+}
+
+// Creates a bare repository with depth commits: one holding every file, then churn files rewritten per commit
+static int generate_source(const char* path, const bench_config* config)
+{
+    git_repository *repo = NULL;
+    unsigned long long seed = 0x9e3779b97f4a7c15ull;
+    int error = git_repository_init(&repo, path, 1);
+    if (error == 0) {
+        error = commit_files(repo, config, 0, config->files, &seed);
+    }
+    for (int i = 1; error == 0 && i < config->depth; i++) {
+        error = commit_files(repo, config, i * config->churn, config->churn, &seed);
+    }
+    if (error == 0) {
+        error = git_repository_set_head(repo, "refs/heads/main");
+    }
+    git_repository_free(repo);
+    return error;
+}
+
+// Runs one update in a child process, so its peak RSS can be read back on its own
+static bench_result run_update(const char* url, const char* target, const bench_config* config)
+{
+    bench_result result;
+    memset(&result, 0, sizeof(result));
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        result.error = -1;
+        return result;
+    }
+
+    double started = monotonic_seconds();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        // Progress lines would drown the report
+        if (!freopen("/dev/null", "w", stdout)) {
+            _exit(1);
+        }
+
+        update_timings timings;
+        update_options opts = UPDATE_OPTIONS_INIT;
+        opts.timings = &timings;
+        opts.checkout_threads = config->threads;
+        opts.staged = config->staged;
+        if (config->low_memory) {
+            opts.mwindow_size = 32 * 1024 * 1024;
+            opts.mwindow_mapped_limit = 256 * 1024 * 1024;
+            opts.cache_max_size = 64 * 1024 * 1024;
+        }
+        int error = update_from_repo(url, target, &opts);
+        if (write(fds[1], &timings, sizeof(timings)) != (ssize_t)sizeof(timings)) {
+            error = -1;
+        }
+        _exit(error == 0 ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        result.error = -1;
+        return result;
+    }
+
+    if (read(fds[0], &result.timings, sizeof(result.timings)) != (ssize_t)sizeof(result.timings)) {
+        result.error = -1;
+    }
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.wall = monotonic_seconds() - started;
+    result.peak_rss_kb = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        result.error = -1;
+    }
+    return result;
+}
+
+static void print_result(const char* scenario, const bench_result* result)
+{
+    printf("%-12s %10.6f %12zu %10u %12ld %s\n", scenario, result->wall, result->timings.received_bytes,
+           result->timings.received_objects, result->peak_rss_kb, result->error ? "failed" : "ok");
+}
+
+// Serves the directory holding the source repository on git:// at 127.0.0.1:port
+static pid_t start_git_daemon(const char* base_path, int port)
+{
+    char base_arg[PATH_MAX + 16], port_arg[32];
+    snprintf(base_arg, sizeof(base_arg), "--base-path=%s", base_path);
+    snprintf(port_arg, sizeof(port_arg), "--port=%d", port);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("git", "git", "daemon", "--reuseaddr", "--export-all", "--listen=127.0.0.1",
+               port_arg, base_arg, base_path, (char*)NULL);
+        _exit(127);
+    }
+    // Give it a moment to start listening
+    usleep(500000);
+    return pid;
+}
+
+int main(int argc, const char** argv)
+{
+    bench_config config = {1000, 16384, 10, 20, 20, 1, 0, "file", NULL, 0};
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--files") == 0) {
+            config.files = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--size") == 0) {
+            config.size = (size_t)atoll(argv[i + 1]);
+        } else if (strcmp(argv[i], "--depth") == 0) {
+            config.depth = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--churn") == 0) {
+            config.churn = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--update-files") == 0) {
+            config.update_files = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            config.threads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--staged") == 0) {
+            config.staged = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--transport") == 0) {
+            config.transport = argv[i + 1];
+        } else if (strcmp(argv[i], "--url") == 0) {
+            config.url = argv[i + 1];
+        } else if (strcmp(argv[i], "--low-memory") == 0) {
+            config.low_memory = atoi(argv[i + 1]);
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (config.files <= 0 || config.depth <= 0) {
+        printf("--files and --depth must be positive\n");
+        return 1;
+    }
+
+    char cwd[PATH_MAX], base[PATH_MAX], source[PATH_MAX], target[PATH_MAX], url[PATH_MAX + 16];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return 1;
+    }
+    snprintf(base, sizeof(base), "%s/bench-repos", cwd);
+    snprintf(source, sizeof(source), "%s/source.git", base);
+    snprintf(target, sizeof(target), "%s/app", base);
+    remove_tree(base);
+    mkdir(base, 0755);
+
+    git_libgit2_init();
+    printf("Generating %d files of %zu bytes, %d commits of %d changed files\n",
+           config.files, config.size, config.depth, config.churn);
+    if (generate_source(source, &config) < 0) {
+        handle_git_error(-1);
+        return 1;
+    }
+
+    pid_t daemon = 0;
+    if (config.url) {
+        snprintf(url, sizeof(url), "%s", config.url);
+    } else if (strcmp(config.transport, "git") == 0) {
+        daemon = start_git_daemon(base, 9419);
+        snprintf(url, sizeof(url), "git://127.0.0.1:9419/source.git");
+    } else {
+        snprintf(url, sizeof(url), "file://%s", source);
+    }
+
+    printf("%-12s %10s %12s %10s %12s\n", "scenario", "wall_s", "bytes", "objects", "peak_rss_kb");
+    bench_result cold = run_update(url, target, &config);
+    print_result("cold_clone", &cold);
+    bench_result noop = run_update(url, target, &config);
+    print_result("no_op", &noop);
+
+    // The update scenario needs a new commit on the source, which only a local source allows
+    if (!config.url) {
+        git_repository *repo = NULL;
+        unsigned long long seed = 0x2545f4914f6cdd1dull;
+        int error = git_repository_open(&repo, source);
+        if (error == 0) {
+            error = commit_files(repo, &config, 0, config.update_files, &seed);
+        }
+        git_repository_free(repo);
+        if (error < 0) {
+            handle_git_error(error);
+        } else {
+            bench_result update = run_update(url, target, &config);
+            char scenario[32];
+            snprintf(scenario, sizeof(scenario), "update_%d", config.update_files);
+            print_result(scenario, &update);
+        }
+    }
+
+    if (daemon > 0) {
+        kill(daemon, SIGTERM);
+        waitpid(daemon, NULL, 0);
+    }
+    git_libgit2_shutdown();
+    return 0;
+}
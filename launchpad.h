@@ -4,13 +4,29 @@
 #include <git2/merge.h>
 #include <git2/remote.h>
 #include <git2/types.h>
+#include <openssl/evp.h>
 
 #include <stdio.h>
 #include <errno.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+#ifdef WIN32
+#include <windows.h>
+#endif
 
 inline int progress_cb(const char *str, int len, void *data)
 {
@@ -65,8 +81,16 @@ inline int fetchhead_cb(const char *ref_name, const char *remote_url, const git_
 
 inline void handle_git_error(int error)
 {
-    const git_error *e = git_error_last();
-    printf("Error %d/%d: %s\n", error, e->klass, e->message);
+    // Errors only last while libgit2 is initialised, the ones raised once it was shut down
+    // have already been printed by os_error. The extra init leaves its count as it was
+    int initialized = git_libgit2_init() > 1;
+    const git_error *e = initialized ? git_error_last() : NULL;
+    if (e) {
+        printf("Error %d/%d: %s\n", error, e->klass, e->message);
+    } else if (initialized) {
+        printf("Error %d\n", error);
+    }
+    git_libgit2_shutdown();
 }
 
 inline const char* copy_string(const char* str)
@@ -77,118 +101,4180 @@ inline const char* copy_string(const char* str)
     return buf;
 }
 
-// Just clones or fetches and hard-resets the repo
-inline int update_from_repo(const char* remote_url, const char* target_path)
+// Options for update_from_repo, start from UPDATE_OPTIONS_INIT
+typedef struct update_options {
+    // Number of commits of history to download, 0 for the full history
+    int depth;
+    // Download the update but leave the working tree alone, the next launch applies it
+    int fetch_only;
+    // Keep each version in its own directory beside target_path and switch with a symlink
+    int staged;
+    // Write files on this many threads instead of through libgit2's checkout, 0 or 1 to use libgit2.
+    // With mwindow_mapped_limit set it is held to 2
+    int checkout_threads;
+    // Pathspecs of files this install never writes, such as another platform's binaries
+    const char** sparse_exclude;
+    size_t sparse_exclude_count;
+    // Seconds after a check during which launches skip the remote, 0 to check every launch
+    int check_interval;
+    // Up to this many seconds are added to each interval at random, so a fleet doesn't check in lockstep
+    int check_jitter;
+    // A git bundle of the main branch on static hosting, used for first installs instead of a clone
+    const char* bundle_url;
+    // Base URL of per-release bundles named <oid>.bundle, tried before fetching an update
+    const char* update_bundle_url;
+    // Base URL of binary patches between releases named <old oid>-<new oid>.patch, tried first
+    const char* patch_url;
+    // Receives transfer progress instead of it being printed, with progress_payload
+    git_indexer_progress_cb transfer_progress;
+    void* progress_payload;
+    // Filled in with how long each phase took, if set
+    struct update_timings* timings;
+    // Caps transfer speed so an update doesn't crowd out the client's own traffic, 0 for no cap
+    size_t max_bytes_per_second;
+    // Run at idle CPU and I/O priority
+    int low_priority;
+    // Repack after an update leaves more than this many packs or loose objects, 0 to never repack
+    int max_packs;
+    int max_loose_objects;
+    // A bare repository shared by every install on the machine, created if missing. Updates are
+    // fetched into it and installs borrow its objects through alternates instead of keeping their own
+    const char* shared_objects;
+    // Git URLs of machines on the same network serving this install, such as one started with
+    // serve_mirror, tried before remote_url. The commit still comes from remote_url
+    const char** mirror_urls;
+    size_t mirror_url_count;
+    // Receives the server's progress messages instead of them being printed, with progress_payload
+    git_transport_message_cb remote_message;
+    // Called as each update_phase ends with the seconds it took, with progress_payload
+    void (*phase_done)(int phase, double seconds, void* payload);
+    // Read while downloading and writing files, once it is nonzero the update stops with GIT_EUSER
+    const int* cancel;
+    // Public keys as in authorized_keys, "ssh-ed25519 AAAA...". When set, nothing is written for a
+    // release unless its commit carries an SSH signature (git config gpg.format ssh) by one of them
+    const char** trusted_keys;
+    size_t trusted_key_count;
+    // The branch to follow, such as "beta", or a full ref such as "refs/tags/v1.4" to stay on one
+    // release. Only this ref is ever fetched. NULL follows main
+    const char* channel;
+    // Caps on libgit2's memory, 0 keeps its default. They apply to the whole process from the
+    // first update that sets them. Pack files are mapped mwindow_size bytes at a time, with at
+    // most mwindow_mapped_limit mapped at once. cache_max_size bounds the cache of parsed
+    // commits and trees that lookups, diffs and checkouts fill. The indexer resolves deltas
+    // through each pack's own base cache, which libgit2 holds to 16 MB, and none of these move it
+    size_t mwindow_size;
+    size_t mwindow_mapped_limit;
+    size_t cache_max_size;
+    // For launch_supervised: a client that fails within early_exit_seconds (default 30) of
+    // starting counts against its version, and max_early_exits of those in a row (default 3)
+    // roll a staged install back to the version it replaced
+    int early_exit_seconds;
+    int max_early_exits;
+    // Set by update_from_repos on the updates it runs. libgit2's options are process-wide, so
+    // the batch sets them once and these updates leave them as they are
+    int in_batch;
+} update_options;
+
+#define UPDATE_OPTIONS_INIT {0}
+
+// The one ref an install follows on the remote and where its tip is kept locally. Whatever the
+// channel, the installed release is the local main branch
+typedef struct update_channel {
+    char remote_ref[256];
+    char tracking_ref[256];
+    char refspec[520];
+} update_channel;
+
+inline void channel_init(update_channel* out, const char* channel)
 {
-    // Perform git operations
-    git_libgit2_init();
+    if (!channel) {
+        channel = "main";
+    }
+    if (strncmp(channel, "refs/", 5) == 0) {
+        snprintf(out->remote_ref, sizeof(out->remote_ref), "%s", channel);
+    } else {
+        snprintf(out->remote_ref, sizeof(out->remote_ref), "refs/heads/%s", channel);
+    }
+    // refs/heads/beta is tracked as refs/remotes/origin/beta, refs/tags/v1.4 as refs/remotes/origin/tags/v1.4
+    const char* name = strncmp(out->remote_ref, "refs/heads/", 11) == 0 ? out->remote_ref + 11 : out->remote_ref + 5;
+    snprintf(out->tracking_ref, sizeof(out->tracking_ref), "refs/remotes/origin/%s", name);
+    snprintf(out->refspec, sizeof(out->refspec), "+%s:%s", out->remote_ref, out->tracking_ref);
+}
 
-    DIR* dir = opendir(target_path);
-    if (dir) {
-        closedir(dir);
+// Creates the clone's remote with a refspec for the update_channel in payload only, or main without one
+inline int single_branch_remote_cb(git_remote **out, git_repository *repo, const char *name, const char *url, void *payload)
+{
+    const update_channel* channel = (const update_channel*)payload;
+    return git_remote_create_with_fetchspec(out, repo, name, url, channel ? channel->refspec : "+refs/heads/main:refs/remotes/origin/main");
+}
 
-        // Open the local repository
-        git_repository *repo = NULL;
-        {
-            int error = git_repository_open(&repo, target_path);
-            if (error < 0) {
-                printf("Directory is not a repository!\n");
-                return error;
+// A tag resolves to the commit it points at, a commit to itself
+inline int peel_to_commit(git_oid* oid, git_repository* repo)
+{
+    git_object *object = NULL, *commit = NULL;
+    int error = git_object_lookup(&object, repo, oid, GIT_OBJECT_ANY);
+    if (error == 0) {
+        error = git_object_peel(&commit, object, GIT_OBJECT_COMMIT);
+    }
+    if (error == 0) {
+        git_oid_cpy(oid, git_object_id(commit));
+    }
+    git_object_free(commit);
+    git_object_free(object);
+    return error;
+}
+
+// Reports a failed system call through the same path as libgit2 errors. After an update has
+// shut libgit2 down, as before launching the client, there is nowhere to keep it, so it is printed
+inline int os_error(const char* what)
+{
+    char message[256];
+    snprintf(message, sizeof(message), "%s: %s", what, strerror(errno));
+    if (git_libgit2_init() > 1) {
+        git_error_set_str(GIT_ERROR_OS, message);
+    } else {
+        printf("Error -1/%d: %s\n", GIT_ERROR_OS, message);
+    }
+    git_libgit2_shutdown();
+    return -1;
+}
+
+inline int cancel_requested(const int* cancel)
+{
+    return cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED);
+}
+
+// A nonzero return from a libgit2 callback comes back as GIT_EUSER, this leaves a message with it
+inline int cancelled_error(void)
+{
+    git_error_set_str(GIT_ERROR_NONE, "update cancelled");
+    return GIT_EUSER;
+}
+
+// Deletes a file or a whole directory tree, without following symlinks
+inline int remove_tree(const char* path)
+{
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(path);
+        if (!dir) {
+            return -1;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
             }
+            char child[PATH_MAX];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            remove_tree(child);
         }
+        closedir(dir);
+        return rmdir(path);
+    }
+    return unlink(path);
+}
 
-        // Create an anonymous remote
-        git_remote *remote = NULL;
-        {
-            int error = git_remote_create_anonymous(&remote, repo, remote_url);
-            if (error < 0) {
-                handle_git_error(error);
-                git_repository_state_cleanup(repo);
-                return error;
-            }
+// A file to write, or to delete when mode is 0
+typedef struct blob_entry {
+    char* path;
+    git_oid oid;
+    unsigned int mode;
+} blob_entry;
+
+typedef struct blob_list {
+    blob_entry* entries;
+    size_t count;
+    size_t capacity;
+} blob_list;
+
+inline void blob_list_push(blob_list* list, const char* path, const git_oid* oid, unsigned int mode)
+{
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->entries = (blob_entry*)realloc(list->entries, list->capacity * sizeof(blob_entry));
+    }
+    blob_entry* entry = &list->entries[list->count++];
+    entry->path = strdup(path);
+    git_oid_cpy(&entry->oid, oid);
+    entry->mode = mode;
+}
+
+inline void blob_list_free(blob_list* list)
+{
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].path);
+    }
+    free(list->entries);
+    list->entries = NULL;
+    list->count = list->capacity = 0;
+}
+
+// Collects every file that differs between two trees, deletions first
+inline int changed_blobs(blob_list* out, git_repository* repo, git_tree* old_tree, git_tree* new_tree)
+{
+    git_diff *diff = NULL;
+    int error = git_diff_tree_to_tree(&diff, repo, old_tree, new_tree, NULL);
+    if (error < 0) {
+        return error;
+    }
+
+    // A file replaced by a directory, or the other way round, must be removed before the new entry is written
+    size_t count = git_diff_num_deltas(diff);
+    for (size_t i = 0; i < count; i++) {
+        const git_diff_delta* delta = git_diff_get_delta(diff, i);
+        if (delta->status == GIT_DELTA_DELETED) {
+            blob_list_push(out, delta->old_file.path, &delta->old_file.id, 0);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        const git_diff_delta* delta = git_diff_get_delta(diff, i);
+        if (delta->status != GIT_DELTA_DELETED && delta->new_file.mode != GIT_FILEMODE_COMMIT) {
+            blob_list_push(out, delta->new_file.path, &delta->new_file.id, delta->new_file.mode);
         }
+    }
 
-        // Fetch and create annotated commit
-        {
-            printf("Checking for updates\n");
-            git_fetch_options fetch_opts = GIT_FETCH_OPTIONS_INIT;
-            fetch_opts.callbacks.update_tips = &update_cb;
-            fetch_opts.callbacks.sideband_progress = &progress_cb;
-            fetch_opts.callbacks.transfer_progress = transfer_progress_cb;
+    git_diff_free(diff);
+    return 0;
+}
 
-            int error = git_remote_fetch(remote, NULL, &fetch_opts, NULL);
-            if (error < 0) {
-                handle_git_error(error);
-                return error;
-            }
+inline int tree_blobs_cb(const char *root, const git_tree_entry *entry, void *payload)
+{
+    if (git_tree_entry_type(entry) == GIT_OBJECT_BLOB) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", root, git_tree_entry_name(entry));
+        blob_list_push((blob_list*)payload, path, git_tree_entry_id(entry), git_tree_entry_filemode(entry));
+    }
+    return 0;
+}
+
+// Collects every file in a tree
+inline int tree_blobs(blob_list* out, git_tree* tree)
+{
+    return git_tree_walk(tree, GIT_TREEWALK_PRE, tree_blobs_cb, out);
+}
+
+// Creates the directories leading up to path
+inline void make_parent_dirs(char* path)
+{
+    for (char* slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+// Writes one blob's raw content to disk, replacing whatever was at its path.
+// Unlinking first means a running executable is never overwritten in place
+inline int write_blob(git_odb* odb, const char* workdir, const blob_entry* entry)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", workdir, entry->path);
+    remove_tree(path);
+    if (entry->mode == 0) {
+        return 0;
+    }
+    make_parent_dirs(path);
+
+    git_odb_object *object = NULL;
+    int error = git_odb_read(&object, odb, &entry->oid);
+    if (error < 0) {
+        return error;
+    }
+    const char* data = (const char*)git_odb_object_data(object);
+    size_t size = git_odb_object_size(object);
+
+    if (entry->mode == GIT_FILEMODE_LINK) {
+        char link_target[PATH_MAX];
+        snprintf(link_target, sizeof(link_target), "%.*s", (int)size, data);
+        if (symlink(link_target, path) != 0) {
+            error = os_error(path);
         }
-        git_annotated_commit *commit = NULL;
-        git_oid oid, tree_oid;
-        git_repository_fetchhead_foreach(repo, fetchhead_cb, &oid);
-        {
-            int error = git_annotated_commit_from_fetchhead(&commit, repo, "main", remote_url, &oid);
-            if (error < 0) {
-                handle_git_error(error);
-                return error;
-            }
+    } else {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, entry->mode == GIT_FILEMODE_BLOB_EXECUTABLE ? 0755 : 0644);
+        if (fd < 0) {
+            error = os_error(path);
         }
-        const git_annotated_commit *heads[1] = {commit};
-        git_merge_analysis_t analysis;
-        git_merge_preference_t preference;
-        {
-            int error = git_merge_analysis(&analysis, &preference, repo, heads, 1);
-            if (error < 0) {
-                handle_git_error(error);
-                return error;
+        for (size_t written = 0; fd >= 0 && written < size; ) {
+            ssize_t n = write(fd, data + written, size - written);
+            if (n < 0) {
+                error = os_error(path);
+                break;
             }
+            written += (size_t)n;
+        }
+        if (fd >= 0) {
+            close(fd);
         }
+    }
 
-        // Check if update is needed
-        if (analysis & GIT_MERGE_ANALYSIS_UP_TO_DATE) {
-            printf("Already up to date\n");
+    git_odb_object_free(object);
+    return error;
+}
+
+typedef struct materialize_job {
+    const char* repo_path;
+    const char* workdir;
+    const blob_list* blobs;
+    size_t next;
+    int error;
+    const int* cancel;
+} materialize_job;
+
+inline void* materialize_worker(void* payload)
+{
+    materialize_job* job = (materialize_job*)payload;
+
+    // libgit2 objects are not shared between threads, so each worker reads through its own repository
+    git_repository *repo = NULL;
+    git_odb *odb = NULL;
+    int error = git_repository_open(&repo, job->repo_path);
+    if (error == 0) {
+        error = git_repository_odb(&odb, repo);
+    }
+    while (error == 0 && __atomic_load_n(&job->error, __ATOMIC_RELAXED) == 0) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->blobs->count) {
+            break;
+        }
+        if (cancel_requested(job->cancel)) {
+            error = cancelled_error();
+            break;
+        }
+        error = write_blob(odb, job->workdir, &job->blobs->entries[i]);
+    }
+    if (error < 0) {
+        __atomic_store_n(&job->error, error, __ATOMIC_RELAXED);
+    }
+
+    git_odb_free(odb);
+    git_repository_free(repo);
+    return NULL;
+}
+
+// Writes a list of blobs into workdir on a pool of threads. Deletions are done
+// first on the calling thread so they can't race a write below the same path.
+// Blobs are written raw, without the filters a libgit2 checkout would apply
+inline int materialize_blobs(git_repository* repo, const char* workdir, const blob_list* blobs, int threads, const int* cancel)
+{
+    git_odb *odb = NULL;
+    int error = git_repository_odb(&odb, repo);
+    size_t first_write = 0;
+    for (; error == 0 && first_write < blobs->count && blobs->entries[first_write].mode == 0; first_write++) {
+        error = write_blob(odb, workdir, &blobs->entries[first_write]);
+    }
+    git_odb_free(odb);
+    if (error < 0) {
+        return error;
+    }
+
+    materialize_job job = {git_repository_path(repo), workdir, blobs, first_write, 0, cancel};
+    pthread_t workers[64];
+    int started = 0;
+    if (threads > 64) {
+        threads = 64;
+    }
+    while (started < threads && pthread_create(&workers[started], NULL, materialize_worker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        materialize_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    return job.error;
+}
+
+// Records freshly written files in the index with their on-disk stat data,
+// so git sees them as clean without hashing them again
+inline int index_written_blobs(git_repository* repo, const blob_list* blobs)
+{
+    git_index *index = NULL;
+    int error = git_repository_index(&index, repo);
+    const char* workdir = git_repository_workdir(repo);
+    for (size_t i = 0; error == 0 && i < blobs->count; i++) {
+        const blob_entry* blob = &blobs->entries[i];
+        if (blob->mode == 0) {
+            git_index_remove(index, blob->path, 0);
+            continue;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", workdir, blob->path);
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            error = os_error(path);
+            break;
+        }
+
+        git_index_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        // libgit2 compares nanoseconds too, an entry without them would be hashed again
+        entry.ctime.seconds = (int32_t)st.st_ctime;
+        entry.ctime.nanoseconds = (uint32_t)st.st_ctim.tv_nsec;
+        entry.mtime.seconds = (int32_t)st.st_mtime;
+        entry.mtime.nanoseconds = (uint32_t)st.st_mtim.tv_nsec;
+        entry.dev = (uint32_t)st.st_dev;
+        entry.ino = (uint32_t)st.st_ino;
+        entry.mode = blob->mode;
+        entry.uid = (uint32_t)st.st_uid;
+        entry.gid = (uint32_t)st.st_gid;
+        entry.file_size = (uint32_t)st.st_size;
+        git_oid_cpy(&entry.id, &blob->oid);
+        entry.path = blob->path;
+        error = git_index_add(index, &entry);
+    }
+    if (error == 0) {
+        error = git_index_write(index);
+    }
+    git_index_free(index);
+    return error;
+}
+
+// Writes blobs into the repository's working tree in parallel and updates the index to match
+inline int materialize_into_workdir(git_repository* repo, const blob_list* blobs, int threads, const int* cancel)
+{
+    // git_repository_workdir ends in a slash
+    char workdir[PATH_MAX];
+    snprintf(workdir, sizeof(workdir), "%s", git_repository_workdir(repo));
+    size_t len = strlen(workdir);
+    if (len > 1 && workdir[len - 1] == '/') {
+        workdir[len - 1] = '\0';
+    }
+
+    int error = materialize_blobs(repo, workdir, blobs, threads, cancel);
+    if (error < 0) {
+        return error;
+    }
+    return index_written_blobs(repo, blobs);
+}
+
+// How files get written: through libgit2's checkout, or through the worker pool
+// when there is more than one thread or some paths are excluded
+typedef struct checkout_plan {
+    int threads;
+    git_pathspec* exclude;
+    const int* cancel;
+} checkout_plan;
+
+inline int plan_uses_workers(const checkout_plan* plan)
+{
+    return plan->threads > 1 || plan->exclude != NULL;
+}
+
+inline int checkout_cancel_cb(git_checkout_notify_t why, const char *path, const git_diff_file *baseline,
+                              const git_diff_file *target, const git_diff_file *workdir, void *payload)
+{
+    (void)why; (void)path; (void)baseline; (void)target; (void)workdir;
+    return cancel_requested((const int*)payload) ? cancelled_error() : 0;
+}
+
+// Checkout options with the given strategy. libgit2 only notifies while it works out what to
+// write, so a cancelled plan stops the checkout before it writes anything, but once writing has
+// started it runs to the end. The plan's own workers check before every file
+inline void plan_checkout_options(git_checkout_options* out, const checkout_plan* plan, unsigned int strategy)
+{
+    git_checkout_options_init(out, GIT_CHECKOUT_OPTIONS_VERSION);
+    out->checkout_strategy = strategy;
+    if (plan->cancel) {
+        out->notify_flags = GIT_CHECKOUT_NOTIFY_UPDATED;
+        out->notify_cb = &checkout_cancel_cb;
+        out->notify_payload = (void*)plan->cancel;
+    }
+}
+
+// The plan opts asks for, free its exclude pathspec when done
+inline int plan_init(checkout_plan* out, const update_options* opts)
+{
+    memset(out, 0, sizeof(*out));
+    out->threads = opts->checkout_threads;
+    // Each worker holds a whole blob in memory while writing it, more than two of them
+    // could add up to more than a capped process is meant to use
+    if (opts->mwindow_mapped_limit > 0 && out->threads > 2) {
+        out->threads = 2;
+    }
+    out->cancel = opts->cancel;
+    if (opts->sparse_exclude_count > 0) {
+        git_strarray exclude = {(char**)opts->sparse_exclude, opts->sparse_exclude_count};
+        return git_pathspec_new(&out->exclude, &exclude);
+    }
+    return 0;
+}
+
+inline int plan_threads(const checkout_plan* plan)
+{
+    return plan->threads > 1 ? plan->threads : 1;
+}
+
+// Drops the files the plan never writes. Deletions stay, removing a file that isn't there is harmless
+inline void blob_list_exclude(blob_list* list, const checkout_plan* plan)
+{
+    if (!plan->exclude) {
+        return;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        blob_entry* entry = &list->entries[i];
+        if (entry->mode != 0 && git_pathspec_matches_path(plan->exclude, 0, entry->path)) {
+            free(entry->path);
         } else {
-            // Now merge
-            printf("Applying update\n");
-            git_merge_options merge_options = GIT_MERGE_OPTIONS_INIT;
-            git_checkout_options checkout_options = GIT_CHECKOUT_OPTIONS_INIT;
-            {
-                int error = git_merge(repo, heads, 1, &merge_options, &checkout_options);
-                if (error < 0) {
-                    handle_git_error(error);
-                    return error;
-                }
+            list->entries[kept++] = *entry;
+        }
+    }
+    list->count = kept;
+}
+
+// Checks out a commit into <target_path>.versions/<oid>, without touching the active version
+inline int stage_version(git_repository* repo, const git_oid* oid, const char* target_path, const checkout_plan* plan)
+{
+    char hex[GIT_OID_SHA1_HEXSIZE+1];
+    git_oid_tostr(hex, sizeof(hex), oid);
+
+    char versions[PATH_MAX], version[PATH_MAX], partial[PATH_MAX];
+    snprintf(versions, sizeof(versions), "%s.versions", target_path);
+    snprintf(version, sizeof(version), "%s/%s", versions, hex);
+    snprintf(partial, sizeof(partial), "%s.partial", version);
+
+    // Finished checkouts are renamed into place, so an existing version is complete
+    if (access(version, F_OK) == 0) {
+        return 0;
+    }
+    if (mkdir(versions, 0755) != 0 && errno != EEXIST) {
+        return os_error(versions);
+    }
+    // Left over from an update that was killed
+    remove_tree(partial);
+
+    git_commit *commit = NULL;
+    int error = git_commit_lookup(&commit, repo, oid);
+    if (error < 0) {
+        return error;
+    }
+
+    if (plan_uses_workers(plan)) {
+        git_tree *tree = NULL;
+        blob_list blobs = {NULL, 0, 0};
+        error = git_commit_tree(&tree, commit);
+        if (error == 0) {
+            error = tree_blobs(&blobs, tree);
+            blob_list_exclude(&blobs, plan);
+        }
+        if (error == 0 && mkdir(partial, 0755) != 0) {
+            error = os_error(partial);
+        }
+        if (error == 0) {
+            error = materialize_blobs(repo, partial, &blobs, plan_threads(plan), plan->cancel);
+        }
+        blob_list_free(&blobs);
+        git_tree_free(tree);
+    } else {
+        // Against an empty baseline every file is new, so one pass writes the whole tree
+        git_index *empty = NULL;
+        error = git_index_new(&empty);
+        if (error == 0) {
+            git_checkout_options checkout_options;
+            plan_checkout_options(&checkout_options, plan, GIT_CHECKOUT_FORCE | GIT_CHECKOUT_DONT_UPDATE_INDEX);
+            checkout_options.target_directory = partial;
+            checkout_options.baseline_index = empty;
+            error = git_checkout_tree(repo, (const git_object*)commit, &checkout_options);
+        }
+        git_index_free(empty);
+    }
+
+    git_commit_free(commit);
+    if (error < 0) {
+        return error;
+    }
+
+    if (rename(partial, version) != 0) {
+        return os_error(version);
+    }
+    return 0;
+}
+
+// Points target_path at a staged version with a single rename, then deletes
+// every version except the new one and the one it replaced
+inline int switch_version(const char* target_path, const git_oid* oid)
+{
+    char hex[GIT_OID_SHA1_HEXSIZE+1];
+    git_oid_tostr(hex, sizeof(hex), oid);
+
+    // The link is relative so the install can be moved
+    const char* name = strrchr(target_path, '/');
+    name = name ? name + 1 : target_path;
+    char link_target[PATH_MAX], link_path[PATH_MAX];
+    snprintf(link_target, sizeof(link_target), "%s.versions/%s", name, hex);
+    snprintf(link_path, sizeof(link_path), "%s.switch", target_path);
+
+    char previous[PATH_MAX] = "";
+    struct stat st;
+    if (lstat(target_path, &st) == 0) {
+        if (S_ISLNK(st.st_mode)) {
+            ssize_t len = readlink(target_path, previous, sizeof(previous) - 1);
+            previous[len > 0 ? len : 0] = '\0';
+        } else if (S_ISDIR(st.st_mode)) {
+            // Installs from before staged mode have a real directory here, set it aside once
+            char old[PATH_MAX];
+            snprintf(old, sizeof(old), "%s.old", target_path);
+            remove_tree(old);
+            if (rename(target_path, old) != 0) {
+                return os_error(target_path);
             }
+        }
+    }
 
-            // A simple hard reset will work
-            {
-                int error = git_reset_from_annotated(repo, heads[0], GIT_RESET_HARD, NULL);
-                if (error < 0) {
-                    handle_git_error(error);
-                    return error;
-                }
+    unlink(link_path);
+    if (symlink(link_target, link_path) != 0) {
+        return os_error(link_path);
+    }
+    if (rename(link_path, target_path) != 0) {
+        return os_error(target_path);
+    }
+
+    // Keep the previous version around, anything older is no longer needed
+    const char* previous_hex = strrchr(previous, '/');
+    previous_hex = previous_hex ? previous_hex + 1 : previous;
+
+    char versions[PATH_MAX];
+    snprintf(versions, sizeof(versions), "%s.versions", target_path);
+    DIR* dir = opendir(versions);
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+                strcmp(entry->d_name, hex) == 0 || strcmp(entry->d_name, previous_hex) == 0) {
+                continue;
             }
+            char stale[PATH_MAX];
+            snprintf(stale, sizeof(stale), "%s/%s", versions, entry->d_name);
+            remove_tree(stale);
         }
+        closedir(dir);
+    }
+    return 0;
+}
+
+// Checks out a commit beside the active version and switches to it, then moves the branch there
+inline int apply_staged(git_repository* repo, const git_oid* oid, const char* target_path, const checkout_plan* plan)
+{
+    int error = stage_version(repo, oid, target_path, plan);
+    if (error < 0) {
+        return error;
+    }
+    error = switch_version(target_path, oid);
+    if (error < 0) {
+        return error;
+    }
 
-        // Free resources
-        git_annotated_commit_free(commit);
+    git_reference *ref = NULL;
+    error = git_reference_create(&ref, repo, "refs/heads/main", oid, 1, "launchpad: switch version");
+    git_reference_free(ref);
+    return error;
+}
 
-        // Clean up repository
-        git_repository_state_cleanup(repo);
-    } else {
-        // First time launching, so download the application
-        printf("Downloading app\n");
+// Moves HEAD's branch to oid and writes only the files that changed, so
+// applying an update costs time proportional to the diff instead of the tree
+inline int apply_changed_paths(git_repository* repo, const git_oid* oid, const checkout_plan* plan)
+{
+    git_reference *head = NULL, *moved = NULL;
+    git_commit *old_commit = NULL, *new_commit = NULL;
+    git_tree *old_tree = NULL, *new_tree = NULL;
+    blob_list blobs = {NULL, 0, 0};
 
-        // Simple git clone
-        git_repository *repo = NULL;
-        int error = git_clone(&repo, remote_url, target_path, NULL);
-        if (error < 0) {
-            handle_git_error(error);
-            exit(error);
+    int error = git_repository_head(&head, repo);
+    if (error == 0) {
+        error = git_commit_lookup(&old_commit, repo, git_reference_target(head));
+    }
+    if (error == 0) {
+        error = git_commit_lookup(&new_commit, repo, oid);
+    }
+    if (error == 0) {
+        error = git_commit_tree(&old_tree, old_commit);
+    }
+    if (error == 0) {
+        error = git_commit_tree(&new_tree, new_commit);
+    }
+    if (error == 0) {
+        error = changed_blobs(&blobs, repo, old_tree, new_tree);
+        blob_list_exclude(&blobs, plan);
+    }
+
+    if (error == 0 && plan_uses_workers(plan)) {
+        error = materialize_into_workdir(repo, &blobs, plan_threads(plan), plan->cancel);
+    } else if (error == 0 && blobs.count > 0) {
+        // An empty path list would mean the whole tree
+        git_strarray paths;
+        paths.strings = (char**)malloc(blobs.count * sizeof(char*));
+        paths.count = blobs.count;
+        for (size_t i = 0; i < blobs.count; i++) {
+            paths.strings[i] = blobs.entries[i].path;
         }
+
+        git_checkout_options checkout_options;
+        plan_checkout_options(&checkout_options, plan, GIT_CHECKOUT_FORCE | GIT_CHECKOUT_DISABLE_PATHSPEC_MATCH);
+        checkout_options.paths = paths;
+        checkout_options.baseline = old_tree;
+        error = git_checkout_tree(repo, (const git_object*)new_commit, &checkout_options);
+        free(paths.strings);
+    }
+    if (error == 0) {
+        error = git_reference_set_target(&moved, head, oid, "launchpad: update");
     }
 
-    // Shut down libgit2
-    git_libgit2_shutdown();
+    blob_list_free(&blobs);
+    git_tree_free(new_tree);
+    git_tree_free(old_tree);
+    git_commit_free(new_commit);
+    git_commit_free(old_commit);
+    git_reference_free(moved);
+    git_reference_free(head);
+    return error;
+}
+
+// Lists the remote's refs and finds the commit ref names, without fetching
+inline int remote_head_oid(git_oid *out, git_remote *remote, const git_remote_callbacks *callbacks, const char *ref)
+{
+    int error = git_remote_connect(remote, GIT_DIRECTION_FETCH, callbacks, NULL, NULL);
+    if (error < 0) {
+        return error;
+    }
+
+    const git_remote_head **refs = NULL;
+    size_t refs_len = 0;
+    error = git_remote_ls(&refs, &refs_len, remote);
+    if (error < 0) {
+        return error;
+    }
+
+    // An annotated tag is advertised twice, the peeled line after it names the commit
+    char peeled[260];
+    snprintf(peeled, sizeof(peeled), "%s^{}", ref);
+    int found = 0;
+    for (size_t i = 0; i < refs_len; i++) {
+        if (strcmp(refs[i]->name, ref) == 0 || strcmp(refs[i]->name, peeled) == 0) {
+            git_oid_cpy(out, &refs[i]->oid);
+            found = 1;
+        }
+    }
+    if (found) {
+        return 0;
+    }
+    char message[300];
+    snprintf(message, sizeof(message), "remote has no %s", ref);
+    git_error_set_str(GIT_ERROR_REFERENCE, message);
+    return GIT_ENOTFOUND;
+}
+
+// What the last run of update_from_repo saw, kept in <target_path>.state so a
+// launch with nothing to do never has to open the repository
+typedef struct update_state {
+    git_oid applied;
+    git_oid remote_head;
+    char remote_url[1024];
+    long long checked;
+    // The version applied before this one, which a staged install still has on disk
+    git_oid previous;
+    // A release that was rolled back here and will not be applied again
+    git_oid rejected;
+    // Failed client starts in a row on the applied version
+    int early_exits;
+} update_state;
+
+inline int read_update_state(update_state* out, const char* target_path)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.state", target_path);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    memset(out, 0, sizeof(*out));
+    int found = 0;
+    char line[1100];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* value = strchr(line, ' ');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(line, "applied") == 0 && git_oid_fromstr(&out->applied, value) == 0) {
+            found |= 1;
+        } else if (strcmp(line, "remote_head") == 0) {
+            git_oid_fromstr(&out->remote_head, value);
+        } else if (strcmp(line, "remote_url") == 0) {
+            snprintf(out->remote_url, sizeof(out->remote_url), "%s", value);
+            found |= 2;
+        } else if (strcmp(line, "checked") == 0) {
+            out->checked = atoll(value);
+        } else if (strcmp(line, "previous") == 0) {
+            git_oid_fromstr(&out->previous, value);
+        } else if (strcmp(line, "rejected") == 0) {
+            git_oid_fromstr(&out->rejected, value);
+        } else if (strcmp(line, "early_exits") == 0) {
+            out->early_exits = atoi(value);
+        }
+    }
+    fclose(file);
+    return found == 3 ? 0 : -1;
+}
+
+// Written to a temporary file and renamed, so a reader never sees half a state
+inline int write_update_state(const update_state* state, const char* target_path)
+{
+    char path[PATH_MAX], temp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.state", target_path);
+    snprintf(temp, sizeof(temp), "%s.state.tmp", target_path);
+    FILE* file = fopen(temp, "w");
+    if (!file) {
+        return os_error(temp);
+    }
 
+    char applied[GIT_OID_SHA1_HEXSIZE+1], remote_head[GIT_OID_SHA1_HEXSIZE+1];
+    char previous[GIT_OID_SHA1_HEXSIZE+1], rejected[GIT_OID_SHA1_HEXSIZE+1];
+    git_oid_tostr(applied, sizeof(applied), &state->applied);
+    git_oid_tostr(remote_head, sizeof(remote_head), &state->remote_head);
+    git_oid_tostr(previous, sizeof(previous), &state->previous);
+    git_oid_tostr(rejected, sizeof(rejected), &state->rejected);
+    fprintf(file, "applied %s\nremote_head %s\nremote_url %s\nchecked %lld\n",
+            applied, remote_head, state->remote_url, state->checked);
+    fprintf(file, "previous %s\nrejected %s\nearly_exits %d\n", previous, rejected, state->early_exits);
+    if (fclose(file) != 0 || rename(temp, path) != 0) {
+        return os_error(path);
+    }
     return 0;
 }
+
+// Records a finished run, a failure to write only costs the next launch its fast path
+inline void record_update_state(const char* target_path, const char* remote_url, const git_oid* applied, const git_oid* remote_head)
+{
+    update_state state, old;
+    memset(&state, 0, sizeof(state));
+    if (read_update_state(&old, target_path) == 0) {
+        // A new version starts with a clean record and remembers the one it replaced
+        int same = git_oid_equal(&old.applied, applied);
+        git_oid_cpy(&state.previous, same ? &old.previous : &old.applied);
+        git_oid_cpy(&state.rejected, &old.rejected);
+        state.early_exits = same ? old.early_exits : 0;
+    }
+    git_oid_cpy(&state.applied, applied);
+    git_oid_cpy(&state.remote_head, remote_head);
+    snprintf(state.remote_url, sizeof(state.remote_url), "%s", remote_url);
+    state.checked = (long long)time(NULL);
+    write_update_state(&state, target_path);
+}
+
+// Downloads url to path with the curl executable, which ships with every
+// platform the client runs on, so the updater needs no HTTP stack of its own.
+// Bytes land in <path>.part, which is kept when the transfer fails, so the
+// next attempt resumes from where this one stopped. The file's ETag is kept in
+// <path>.part.etag and sent as If-Range, a server whose file has changed since,
+// or that is serving a different url, sends it whole and the part starts over.
+// progress, which may be NULL, gets the bytes so far every tenth of a second, and
+// a nonzero return stops curl and is returned. Progress is never printed here, the
+// update's renderer owns the line
+inline int download_file(const char* url, const char* path, size_t max_bytes_per_second,
+                         git_indexer_progress_cb progress, void* payload)
+{
+    char rate[32];
+    snprintf(rate, sizeof(rate), "%zu", max_bytes_per_second);
+
+    char part[PATH_MAX], etag_path[PATH_MAX + 8];
+    snprintf(part, sizeof(part), "%s.part", path);
+    snprintf(etag_path, sizeof(etag_path), "%s.etag", part);
+
+    int status = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // Without a validator there is no telling whose bytes the part holds
+        char etag[256] = "", if_range[300];
+        FILE* etag_file = fopen(etag_path, "r");
+        if (etag_file) {
+            if (!fgets(etag, sizeof(etag), etag_file)) {
+                etag[0] = '\0';
+            }
+            etag[strcspn(etag, "\r\n")] = '\0';
+            fclose(etag_file);
+        }
+        if (etag[0] == '\0') {
+            unlink(part);
+        }
+        snprintf(if_range, sizeof(if_range), "If-Range: %s", etag);
+
+        const char* args[24];
+        int argc = 0;
+        args[argc++] = "curl";
+        args[argc++] = "--fail";
+        args[argc++] = "--silent";
+        args[argc++] = "--show-error";
+        args[argc++] = "--location";
+        args[argc++] = "--retry";
+        args[argc++] = "3";
+        args[argc++] = "--continue-at";
+        args[argc++] = "-";
+        args[argc++] = "--etag-save";
+        args[argc++] = etag_path;
+        if (etag[0] != '\0') {
+            args[argc++] = "--header";
+            args[argc++] = if_range;
+        }
+        if (max_bytes_per_second > 0) {
+            args[argc++] = "--limit-rate";
+            args[argc++] = rate;
+        }
+        args[argc++] = "--output";
+        args[argc++] = part;
+        args[argc++] = url;
+        args[argc] = NULL;
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            execvp("curl", (char* const*)args);
+            _exit(127);
+        }
+        if (pid < 0) {
+            return os_error("fork");
+        }
+
+        // The part file is the checkpoint, report its size while curl runs
+        pid_t done;
+        while ((done = waitpid(pid, &status, WNOHANG)) == 0) {
+            struct stat st;
+            size_t size = stat(part, &st) == 0 ? (size_t)st.st_size : 0;
+            if (progress) {
+                git_indexer_progress stats;
+                memset(&stats, 0, sizeof(stats));
+                stats.received_bytes = size;
+                int error = progress(&stats, payload);
+                if (error != 0) {
+                    // What has arrived stays in the part for the next attempt
+                    kill(pid, SIGTERM);
+                    waitpid(pid, NULL, 0);
+                    return error;
+                }
+            }
+            usleep(100000);
+        }
+        if (done < 0) {
+            return os_error("waitpid");
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            unlink(etag_path);
+            if (rename(part, path) != 0) {
+                return os_error(path);
+            }
+            return 0;
+        }
+
+        // The server can't resume this file, or it changed, start it over once
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 33 && WEXITSTATUS(status) != 36)) {
+            break;
+        }
+        unlink(part);
+        unlink(etag_path);
+    }
+
+    char message[PATH_MAX + 32];
+    snprintf(message, sizeof(message), "could not download %s", url);
+    git_error_set_str(GIT_ERROR_NET, message);
+    return -1;
+}
+
+// Indexes the pack inside a git bundle into the repository and finds the commit of ref in it.
+// The indexer reports to progress, which may be NULL, and stops when it returns nonzero
+inline int unbundle(git_oid* head_out, git_repository* repo, const char* bundle_path, const char* ref,
+                    git_indexer_progress_cb progress, void* payload)
+{
+    FILE* file = fopen(bundle_path, "rb");
+    if (!file) {
+        return os_error(bundle_path);
+    }
+
+    git_odb *odb = NULL;
+    int error = git_repository_odb(&odb, repo);
+
+    // The header is text up to a blank line: a signature, then for v3 capabilities,
+    // prerequisite commits as "-<oid>" and refs as "<oid> <refname>"
+    char line[1024];
+    int found_head = 0;
+    if (error == 0 && (!fgets(line, sizeof(line), file) ||
+        (strcmp(line, "# v2 git bundle\n") != 0 && strcmp(line, "# v3 git bundle\n") != 0))) {
+        git_error_set_str(GIT_ERROR_INVALID, "not a git bundle");
+        error = -1;
+    }
+    while (error == 0 && fgets(line, sizeof(line), file) && strcmp(line, "\n") != 0) {
+        git_oid oid;
+        if (line[0] == '@') {
+            if (strncmp(line, "@object-format=", 15) == 0 && strcmp(line, "@object-format=sha1\n") != 0) {
+                git_error_set_str(GIT_ERROR_INVALID, "bundle uses an unsupported object format");
+                error = -1;
+            }
+        } else if (line[0] == '-') {
+            if (git_oid_fromstrn(&oid, line + 1, GIT_OID_SHA1_HEXSIZE) != 0 || !git_odb_exists(odb, &oid)) {
+                git_error_set_str(GIT_ERROR_INVALID, "bundle needs commits this repository does not have");
+                error = -1;
+            }
+        } else if (git_oid_fromstrn(&oid, line, GIT_OID_SHA1_HEXSIZE) == 0) {
+            const char* name = line + GIT_OID_SHA1_HEXSIZE + 1;
+            size_t name_len = strlen(name) - 1;
+            if ((name_len == strlen(ref) && strncmp(name, ref, name_len) == 0) ||
+                (!found_head && strcmp(ref, "refs/heads/main") == 0 && strcmp(name, "HEAD\n") == 0)) {
+                git_oid_cpy(head_out, &oid);
+                found_head = 1;
+            }
+        }
+    }
+    if (error == 0 && !found_head) {
+        git_error_set_str(GIT_ERROR_INVALID, "bundle does not have the channel's ref");
+        error = -1;
+    }
+
+    // Everything after the header is a pack, stream it through the indexer
+    git_indexer *indexer = NULL;
+    git_indexer_progress stats;
+    char pack_dir[PATH_MAX];
+    snprintf(pack_dir, sizeof(pack_dir), "%sobjects/pack", git_repository_path(repo));
+    git_indexer_options indexer_opts = GIT_INDEXER_OPTIONS_INIT;
+    indexer_opts.progress_cb = progress;
+    indexer_opts.progress_cb_payload = payload;
+    if (error == 0) {
+        error = git_indexer_new(&indexer, pack_dir, 0, odb, &indexer_opts);
+    }
+    char buffer[65536];
+    size_t len = 0;
+    while (error == 0 && (len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        error = git_indexer_append(indexer, buffer, len, &stats);
+    }
+    if (error == 0) {
+        error = git_indexer_commit(indexer, &stats);
+    }
+    if (error == 0) {
+        error = peel_to_commit(head_out, repo);
+    }
+
+    git_indexer_free(indexer);
+    git_odb_free(odb);
+    fclose(file);
+    return error;
+}
+
+// Creates the repository from a downloaded bundle, with the same origin remote a clone would have,
+// so every later update is a normal fetch
+inline int install_from_bundle(git_repository** out, const char* bundle_url, const char* remote_url, const char* repo_path, const char* target_path,
+                               const update_channel* channel, int bare, size_t max_bytes_per_second,
+                               git_indexer_progress_cb progress, void* payload)
+{
+    char bundle_path[PATH_MAX];
+    snprintf(bundle_path, sizeof(bundle_path), "%s.bundle", target_path);
+
+    *out = NULL;
+    git_repository *repo = NULL;
+    git_remote *origin = NULL;
+    git_reference *ref = NULL;
+    git_oid head_oid;
+
+    int error = download_file(bundle_url, bundle_path, max_bytes_per_second, progress, payload);
+    if (error < 0) {
+        return error;
+    }
+    error = git_repository_init(&repo, repo_path, bare);
+    if (error == 0) {
+        error = single_branch_remote_cb(&origin, repo, "origin", remote_url, (void*)channel);
+        git_remote_free(origin);
+    }
+    if (error == 0) {
+        error = unbundle(&head_oid, repo, bundle_path, channel->remote_ref, progress, payload);
+    }
+    if (error == 0) {
+        error = git_reference_create(&ref, repo, channel->tracking_ref, &head_oid, 1, "launchpad: bundle");
+        git_reference_free(ref);
+    }
+    if (error == 0) {
+        error = git_reference_create(&ref, repo, "refs/heads/main", &head_oid, 1, "launchpad: bundle");
+        git_reference_free(ref);
+    }
+    if (error == 0) {
+        error = git_repository_set_head(repo, "refs/heads/main");
+    }
+    unlink(bundle_path);
+
+    if (error < 0) {
+        git_repository_free(repo);
+        return error;
+    }
+    *out = repo;
+    return 0;
+}
+
+// Applies the bundle <update_bundle_url><oid>.bundle to an existing repository. Release bundles
+// only carry what is new since the previous release, so this fails when the repository is further
+// behind, and the caller fetches instead
+inline int fetch_update_bundle(git_repository* repo, const char* update_bundle_url, const char* target_path, const update_channel* channel,
+                               const git_oid* oid, size_t max_bytes_per_second, git_indexer_progress_cb progress, void* payload)
+{
+    char hex[GIT_OID_SHA1_HEXSIZE+1];
+    git_oid_tostr(hex, sizeof(hex), oid);
+    char url[PATH_MAX], bundle_path[PATH_MAX];
+    snprintf(url, sizeof(url), "%s%s.bundle", update_bundle_url, hex);
+    snprintf(bundle_path, sizeof(bundle_path), "%s.update.bundle", target_path);
+
+    int error = download_file(url, bundle_path, max_bytes_per_second, progress, payload);
+    if (error < 0) {
+        return error;
+    }
+
+    git_oid head_oid;
+    error = unbundle(&head_oid, repo, bundle_path, channel->remote_ref, progress, payload);
+    unlink(bundle_path);
+    if (error == 0 && !git_oid_equal(&head_oid, oid)) {
+        git_error_set_str(GIT_ERROR_INVALID, "bundle is for a different commit");
+        error = -1;
+    }
+
+    // Later fetches offer the commit as one we have
+    if (error == 0) {
+        git_reference *ref = NULL;
+        error = git_reference_create(&ref, repo, channel->tracking_ref, oid, 1, "launchpad: bundle");
+        git_reference_free(ref);
+    }
+    return error;
+}
+
+// Applies the patch <patch_url><old>-<new>.patch for an update from old_oid to new_oid.
+// A patch is "commit <size>\n", the raw commit object, then the output of
+// git diff --binary --full-index <old> <new>. Binary files travel as deltas
+// against the previous release instead of whole blobs. The commit is written
+// as-is and the diff is applied to the old tree, which puts every object of
+// the new commit in the repository. The oids of the commit and its tree prove
+// the result is exactly the release, so nothing unverified is ever checked out
+inline int fetch_update_patch(git_repository* repo, const char* patch_url, const char* target_path, const update_channel* channel,
+                              const git_oid* old_oid, const git_oid* new_oid, size_t max_bytes_per_second,
+                              git_indexer_progress_cb progress, void* payload)
+{
+    char old_hex[GIT_OID_SHA1_HEXSIZE+1], new_hex[GIT_OID_SHA1_HEXSIZE+1];
+    git_oid_tostr(old_hex, sizeof(old_hex), old_oid);
+    git_oid_tostr(new_hex, sizeof(new_hex), new_oid);
+    char url[PATH_MAX], patch_path[PATH_MAX];
+    snprintf(url, sizeof(url), "%s%s-%s.patch", patch_url, old_hex, new_hex);
+    snprintf(patch_path, sizeof(patch_path), "%s.patch", target_path);
+
+    int error = download_file(url, patch_path, max_bytes_per_second, progress, payload);
+    if (error < 0) {
+        return error;
+    }
+
+    // Patches are small next to the blobs they replace, so read it whole
+    FILE* file = fopen(patch_path, "rb");
+    if (!file) {
+        return os_error(patch_path);
+    }
+    fseek(file, 0, SEEK_END);
+    long patch_len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    // Terminated, so parsing the header of a truncated patch stops at its end
+    char* patch = (char*)malloc(patch_len > 0 ? (size_t)patch_len + 1 : 1);
+    size_t len = fread(patch, 1, patch_len > 0 ? (size_t)patch_len : 0, file);
+    patch[len] = '\0';
+    fclose(file);
+    unlink(patch_path);
+
+    git_odb *odb = NULL;
+    git_commit *old_commit = NULL;
+    git_tree *old_tree = NULL;
+    git_diff *diff = NULL;
+    git_index *index = NULL;
+    git_oid written, tree_oid, release_tree_oid;
+
+    size_t commit_len = 0;
+    int header_len = 0;
+    error = git_repository_odb(&odb, repo);
+    if (error == 0 && (sscanf(patch, "commit %zu\n%n", &commit_len, &header_len) != 1 ||
+        header_len == 0 || (size_t)header_len + commit_len > len)) {
+        git_error_set_str(GIT_ERROR_INVALID, "malformed update patch");
+        error = -1;
+    }
+    // Nothing is written until the patched tree checks out. A commit without its tree would
+    // look present to the fallback fetch, which would then not download it
+    if (error == 0) {
+        error = git_odb_hash(&written, patch + header_len, commit_len, GIT_OBJECT_COMMIT);
+    }
+    if (error == 0 && !git_oid_equal(&written, new_oid)) {
+        git_error_set_str(GIT_ERROR_INVALID, "patch is for a different commit");
+        error = -1;
+    }
+    // A commit starts with the id of its tree
+    if (error == 0 && (commit_len < 5 + GIT_OID_SHA1_HEXSIZE || strncmp(patch + header_len, "tree ", 5) != 0 ||
+        git_oid_fromstrn(&release_tree_oid, patch + header_len + 5, GIT_OID_SHA1_HEXSIZE) < 0)) {
+        git_error_set_str(GIT_ERROR_INVALID, "malformed update patch");
+        error = -1;
+    }
+    if (error == 0) {
+        error = git_commit_lookup(&old_commit, repo, old_oid);
+    }
+    if (error == 0) {
+        error = git_commit_tree(&old_tree, old_commit);
+    }
+    if (error == 0) {
+        error = git_diff_from_buffer(&diff, patch + header_len + commit_len, len - header_len - commit_len);
+    }
+    if (error == 0) {
+        error = git_apply_to_tree(&index, repo, old_tree, diff, NULL);
+    }
+    if (error == 0) {
+        error = git_index_write_tree_to(&tree_oid, index, repo);
+    }
+    if (error == 0 && !git_oid_equal(&tree_oid, &release_tree_oid)) {
+        git_error_set_str(GIT_ERROR_INVALID, "patched tree does not match the release");
+        error = -1;
+    }
+    if (error == 0) {
+        error = git_odb_write(&written, odb, patch + header_len, commit_len, GIT_OBJECT_COMMIT);
+    }
+
+    // Later fetches offer the commit as one we have
+    if (error == 0) {
+        git_reference *ref = NULL;
+        error = git_reference_create(&ref, repo, channel->tracking_ref, new_oid, 1, "launchpad: patch");
+        git_reference_free(ref);
+    }
+
+    git_index_free(index);
+    git_diff_free(diff);
+    git_tree_free(old_tree);
+    git_commit_free(old_commit);
+    git_odb_free(odb);
+    free(patch);
+    return error;
+}
+
+// Whether the commit and its root tree are both in the object database. Packs are indexed
+// whole and trees are written after their subtrees, so a root tree comes with the rest
+inline int have_commit_and_tree(git_repository* repo, const git_oid* oid)
+{
+    git_commit *commit = NULL;
+    git_odb *odb = NULL;
+    int found = git_commit_lookup(&commit, repo, oid) == 0 && git_repository_odb(&odb, repo) == 0 &&
+                git_odb_exists(odb, git_commit_tree_id(commit));
+    git_odb_free(odb);
+    git_commit_free(commit);
+    return found;
+}
+
+// Writes HEAD's tree into a working tree that has not been checked out yet
+inline int checkout_head_tree(git_repository* repo, const checkout_plan* plan)
+{
+    if (!plan_uses_workers(plan)) {
+        git_checkout_options checkout_options;
+        plan_checkout_options(&checkout_options, plan, GIT_CHECKOUT_FORCE);
+        return git_checkout_head(repo, &checkout_options);
+    }
+
+    git_commit *head = NULL;
+    git_tree *tree = NULL;
+    blob_list blobs = {NULL, 0, 0};
+    git_oid head_oid;
+    int error = git_reference_name_to_id(&head_oid, repo, "HEAD");
+    if (error == 0) {
+        error = git_commit_lookup(&head, repo, &head_oid);
+    }
+    if (error == 0) {
+        error = git_commit_tree(&tree, head);
+    }
+    if (error == 0) {
+        error = tree_blobs(&blobs, tree);
+        blob_list_exclude(&blobs, plan);
+    }
+    if (error == 0) {
+        error = materialize_into_workdir(repo, &blobs, plan_threads(plan), plan->cancel);
+    }
+    blob_list_free(&blobs);
+    git_tree_free(tree);
+    git_commit_free(head);
+    return error;
+}
+
+// What repeated fetches have left in a repository's object database
+typedef struct odb_stats {
+    int packs;
+    size_t pack_bytes;
+    int loose_objects;
+} odb_stats;
+
+inline int has_suffix(const char* str, const char* suffix)
+{
+    size_t len = strlen(str), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+inline int read_odb_stats(odb_stats* out, const char* objects_path)
+{
+    char path[PATH_MAX];
+    struct dirent* entry;
+    struct stat st;
+    memset(out, 0, sizeof(*out));
+
+    snprintf(path, sizeof(path), "%s/pack", objects_path);
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return os_error(path);
+    }
+    while ((entry = readdir(dir))) {
+        snprintf(path, sizeof(path), "%s/pack/%s", objects_path, entry->d_name);
+        if (has_suffix(entry->d_name, ".pack") && stat(path, &st) == 0) {
+            out->packs++;
+            out->pack_bytes += (size_t)st.st_size;
+        }
+    }
+    closedir(dir);
+
+    // Loose objects live in objects/00 to objects/ff
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), "%s/%02x", objects_path, i);
+        dir = opendir(path);
+        if (!dir) {
+            continue;
+        }
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] != '.') {
+                out->loose_objects++;
+            }
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+// Deletes packs older than before other than keep_name, along with their indexes.
+// Anything newer came from a fetch that started after the repack did, so it stays
+inline void prune_packs(const char* objects_path, const char* keep_name, time_t before)
+{
+    char dir_path[PATH_MAX], path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s/pack", objects_path);
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        return;
+    }
+
+    struct dirent* entry;
+    struct stat st;
+    while ((entry = readdir(dir))) {
+        if (!has_suffix(entry->d_name, ".pack") || strstr(entry->d_name, keep_name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (stat(path, &st) != 0 || st.st_mtime >= before) {
+            continue;
+        }
+        size_t base_len = strlen(path) - strlen(".pack");
+        snprintf(path + base_len, sizeof(path) - base_len, ".keep");
+        if (access(path, F_OK) == 0) {
+            continue;
+        }
+
+        // The index goes first, so a pack is never listed without its data
+        static const char* const suffixes[] = {".idx", ".rev", ".pack"};
+        for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+            snprintf(path + base_len, sizeof(path) - base_len, "%s", suffixes[i]);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+inline void prune_loose_objects(const char* objects_path, time_t before)
+{
+    char dir_path[PATH_MAX], path[PATH_MAX];
+    struct dirent* entry;
+    struct stat st;
+    for (int i = 0; i < 256; i++) {
+        snprintf(dir_path, sizeof(dir_path), "%s/%02x", objects_path, i);
+        DIR* dir = opendir(dir_path);
+        if (!dir) {
+            continue;
+        }
+        while ((entry = readdir(dir))) {
+            snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+            if (entry->d_name[0] != '.' && stat(path, &st) == 0 && st.st_mtime < before) {
+                unlink(path);
+            }
+        }
+        closedir(dir);
+        // Fails while the directory still has newer objects in it
+        rmdir(dir_path);
+    }
+}
+
+// Queues what oid names for repack_repository: commits go to the walk, annotated tags are
+// packed themselves and followed to what they tag, trees and blobs are packed with their contents.
+// An object missing from the database is skipped, there is nothing of it left to keep
+inline int queue_repack_target(git_packbuilder* builder, git_revwalk* walk, git_repository* repo, const git_oid* oid)
+{
+    git_object *object = NULL;
+    git_object *target = NULL;
+    int error = 0;
+    if (git_object_lookup(&object, repo, oid, GIT_OBJECT_ANY) < 0) {
+        return 0;
+    }
+    while (error == 0 && object && git_object_type(object) == GIT_OBJECT_TAG) {
+        error = git_packbuilder_insert(builder, git_object_id(object), NULL);
+        if (error == 0 && git_tag_target(&target, (git_tag*)object) < 0) {
+            target = NULL;
+        }
+        git_object_free(object);
+        object = target;
+        target = NULL;
+    }
+    if (error == 0 && object) {
+        if (git_object_type(object) == GIT_OBJECT_COMMIT) {
+            error = git_revwalk_push(walk, git_object_id(object));
+        } else {
+            error = git_packbuilder_insert_recur(builder, git_object_id(object), NULL);
+        }
+    }
+    git_object_free(object);
+    return error;
+}
+
+// Rewrites everything reachable from the refs and from fetched into a single pack,
+// then drops the old packs and loose objects, along with history nothing points to anymore
+inline int repack_repository(git_repository* repo, const git_oid* fetched)
+{
+    git_buf objects = GIT_BUF_INIT;
+    git_revwalk *walk = NULL;
+    git_packbuilder *builder = NULL;
+    git_reference_iterator *refs = NULL;
+    git_reference *ref = NULL;
+    char pack_path[PATH_MAX];
+    // Whole seconds, so anything written during the repack compares as newer
+    time_t started = time(NULL) - 1;
+
+    int error = git_repository_item_path(&objects, repo, GIT_REPOSITORY_ITEM_OBJECTS);
+    if (error == 0) {
+        error = git_revwalk_new(&walk, repo);
+    }
+    if (error == 0) {
+        error = git_packbuilder_new(&builder, repo);
+    }
+    if (error == 0) {
+        error = git_reference_iterator_new(&refs, repo);
+    }
+    // Every ref has to make it in, whatever it was left out of the pack would be pruned with the old ones
+    int next = 0;
+    while (error == 0 && (next = git_reference_next(&ref, refs)) == 0) {
+        // A symbolic ref names another ref, which the iterator visits on its own
+        if (git_reference_type(ref) == GIT_REFERENCE_DIRECT) {
+            error = queue_repack_target(builder, walk, repo, git_reference_target(ref));
+        }
+        git_reference_free(ref);
+    }
+    if (error == 0 && next != GIT_ITEROVER) {
+        error = next;
+    }
+    // A fetch only update is held by FETCH_HEAD until the next launch applies it
+    if (error == 0 && fetched && !git_oid_is_zero(fetched)) {
+        error = queue_repack_target(builder, walk, repo, fetched);
+    }
+    if (error == 0) {
+        error = git_packbuilder_insert_walk(builder, walk);
+    }
+    if (error == 0) {
+        snprintf(pack_path, sizeof(pack_path), "%s/pack", objects.ptr);
+        error = git_packbuilder_write(builder, pack_path, 0, NULL, NULL);
+    }
+    if (error == 0) {
+        prune_packs(objects.ptr, git_packbuilder_name(builder), started);
+        prune_loose_objects(objects.ptr, started);
+    }
+
+    git_reference_iterator_free(refs);
+    git_packbuilder_free(builder);
+    git_revwalk_free(walk);
+    git_buf_dispose(&objects);
+    return error;
+}
+
+// Repacks once the object database passes the limits in opts, which keeps opening the
+// repository and looking up objects as fast after months of updates as after the install.
+// Without may_repack it only reads the stats, a run the client is waiting on leaves the
+// repack to maintain_in_background
+inline int maintain_repository(git_repository* repo, const git_oid* fetched, const update_options* opts, odb_stats* stats,
+                               int may_repack)
+{
+    git_buf objects = GIT_BUF_INIT;
+    char path[PATH_MAX];
+    int error = git_repository_item_path(&objects, repo, GIT_REPOSITORY_ITEM_OBJECTS);
+    if (error == 0) {
+        error = read_odb_stats(stats, objects.ptr);
+    }
+    // Packing would copy a shared store's objects back into this repository, the store is maintained instead
+    if (error == 0) {
+        snprintf(path, sizeof(path), "%s/info/alternates", objects.ptr);
+        if (access(path, F_OK) == 0) {
+            git_buf_dispose(&objects);
+            return 0;
+        }
+    }
+    int over_limit = (opts->max_packs > 0 && stats->packs > opts->max_packs) ||
+                     (opts->max_loose_objects > 0 && stats->loose_objects > opts->max_loose_objects);
+    if (error == 0 && over_limit && may_repack) {
+        printf("Repacking %d packs and %d loose objects\n", stats->packs, stats->loose_objects);
+        error = repack_repository(repo, fetched);
+        if (error == 0) {
+            error = read_odb_stats(stats, objects.ptr);
+        }
+    }
+    git_buf_dispose(&objects);
+    return error;
+}
+
+// Resolves path against the working directory without requiring it to exist yet
+inline void absolute_path(char* out, size_t size, const char* path)
+{
+    char cwd[PATH_MAX];
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+    }
+    if (path[0] == '/' || !getcwd(cwd, sizeof(cwd))) {
+        snprintf(out, size, "%s", path);
+    } else {
+        snprintf(out, size, "%s/%s", cwd, path);
+    }
+}
+
+inline int open_shared_objects(git_repository** out, const char* shared_path)
+{
+    if (git_repository_open_bare(out, shared_path) == 0) {
+        return 0;
+    }
+    // Installs run as different users, so everyone gets to write to it
+    git_repository_init_options init_opts = GIT_REPOSITORY_INIT_OPTIONS_INIT;
+    init_opts.flags = GIT_REPOSITORY_INIT_BARE | GIT_REPOSITORY_INIT_MKPATH;
+    init_opts.mode = GIT_REPOSITORY_INIT_SHARED_ALL;
+    return git_repository_init_ext(out, shared_path, &init_opts);
+}
+
+// Adds the lines of from that to is missing. A shallow store's grafts have to be known to
+// every repository borrowing its objects, or walking history runs off into missing parents
+inline int merge_shallow_file(const char* from, const char* to)
+{
+    char from_lines[64 * 1024], to_lines[64 * 1024], line[GIT_OID_SHA1_HEXSIZE + 2];
+    size_t to_len = 0;
+
+    FILE* file = fopen(to, "r");
+    if (file) {
+        to_len = fread(to_lines, 1, sizeof(to_lines) - 1, file);
+        fclose(file);
+    }
+    to_lines[to_len] = '\0';
+
+    file = fopen(from, "r");
+    if (!file) {
+        return 0;
+    }
+    size_t from_len = fread(from_lines, 1, sizeof(from_lines) - 1, file);
+    fclose(file);
+    from_lines[from_len] = '\0';
+
+    FILE* out = NULL;
+    for (char* start = from_lines; *start; ) {
+        char* end = strchr(start, '\n');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        if (len == GIT_OID_SHA1_HEXSIZE) {
+            snprintf(line, sizeof(line), "%.*s\n", (int)len, start);
+            if (!strstr(to_lines, line)) {
+                if (!out && !(out = fopen(to, "a"))) {
+                    return os_error(to);
+                }
+                fputs(line, out);
+            }
+        }
+        start += len + (end ? 1 : 0);
+    }
+    if (out) {
+        fclose(out);
+    }
+    return 0;
+}
+
+// Points the repository's object database at the shared store's
+inline int link_shared_objects(git_repository* repo, const char* shared_path)
+{
+    git_buf objects = GIT_BUF_INIT;
+    char shared_abs[PATH_MAX], shared_objects[PATH_MAX], path[PATH_MAX], from[PATH_MAX], line[PATH_MAX];
+    absolute_path(shared_abs, sizeof(shared_abs), shared_path);
+    snprintf(shared_objects, sizeof(shared_objects), "%s/objects", shared_abs);
+    int linked = 0;
+
+    int error = git_repository_item_path(&objects, repo, GIT_REPOSITORY_ITEM_OBJECTS);
+    if (error == 0) {
+        snprintf(path, sizeof(path), "%s/info", objects.ptr);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/info/alternates", objects.ptr);
+        // Already linked by an earlier update, the open repository loaded the alternate with it
+        FILE* file = fopen(path, "r");
+        if (file) {
+            if (fgets(line, sizeof(line), file)) {
+                line[strcspn(line, "\n")] = '\0';
+                linked = strcmp(line, shared_objects) == 0;
+            }
+            fclose(file);
+        }
+        file = linked ? NULL : fopen(path, "w");
+        if (!linked && !file) {
+            error = os_error(path);
+        } else if (file) {
+            fprintf(file, "%s\n", shared_objects);
+            fclose(file);
+        }
+    }
+    if (error == 0) {
+        snprintf(from, sizeof(from), "%s/shallow", shared_abs);
+        snprintf(path, sizeof(path), "%s/shallow", git_repository_path(repo));
+        error = merge_shallow_file(from, path);
+    }
+    // The alternates file is only read when the repository is opened, so one that is already
+    // open needs the store added to its object database directly
+    if (error == 0 && !linked) {
+        git_odb* odb = NULL;
+        error = git_repository_odb(&odb, repo);
+        if (error == 0) {
+            error = git_odb_add_disk_alternate(odb, shared_objects);
+        }
+        git_odb_free(odb);
+    }
+    git_buf_dispose(&objects);
+    return error;
+}
+
+// Names the shared store's ref called name for the install at target_path, each install has its own
+inline int shared_install_ref(char* out, size_t size, const char* target_path, const char* name)
+{
+    char target_abs[PATH_MAX], hex[GIT_OID_SHA1_HEXSIZE+1];
+    git_oid key;
+    absolute_path(target_abs, sizeof(target_abs), target_path);
+    int error = git_odb_hash(&key, target_abs, strlen(target_abs), GIT_OBJECT_BLOB);
+    if (error < 0) {
+        return error;
+    }
+    git_oid_tostr(hex, sizeof(hex), &key);
+    snprintf(out, size, "refs/installs/%s/%s", hex, name);
+    return 0;
+}
+
+// Points the install's applied ref in the store at oid, and its previous ref at the version
+// applied before, which a staged install can still roll back to. The store is only repacked
+// from its refs, so these hold every version an install has on disk
+inline int retain_shared_version(const char* shared_path, const char* target_path, const git_oid* oid)
+{
+    git_repository *shared = NULL;
+    git_reference *ref = NULL;
+    char applied_ref[96], previous_ref[96];
+    git_oid old;
+
+    int error = shared_install_ref(applied_ref, sizeof(applied_ref), target_path, "applied");
+    if (error == 0) {
+        error = shared_install_ref(previous_ref, sizeof(previous_ref), target_path, "previous");
+    }
+    if (error == 0) {
+        error = open_shared_objects(&shared, shared_path);
+    }
+    if (error == 0 && git_reference_name_to_id(&old, shared, applied_ref) == 0 && !git_oid_equal(&old, oid)) {
+        error = git_reference_create(&ref, shared, previous_ref, &old, 1, "launchpad: replaced");
+        git_reference_free(ref);
+    }
+    if (error == 0) {
+        error = git_reference_create(&ref, shared, applied_ref, oid, 1, "launchpad: applied");
+        git_reference_free(ref);
+    }
+    git_repository_free(shared);
+    return error;
+}
+
+// Fetches the main branch into the shared store, under a ref of its own for each install.
+// The fetched commit isn't applied yet, so installed, the version the install is on, is
+// recorded as applied before the store is repacked. Objects another install already fetched
+// are offered as haves and never downloaded twice
+inline int fetch_into_shared(git_oid* out, const char* shared_path, const char* remote_url, const char* target_path,
+                             const git_oid* installed, const update_channel* channel, const git_remote_callbacks* callbacks,
+                             const update_options* opts)
+{
+    git_repository *shared = NULL;
+    git_remote *remote = NULL;
+    char refspec[400], refname[96];
+
+    int error = shared_install_ref(refname, sizeof(refname), target_path, "main");
+    if (error < 0) {
+        return error;
+    }
+    snprintf(refspec, sizeof(refspec), "+%s:%s", channel->remote_ref, refname);
+
+    // Installs from before the applied ref existed get theirs here, ahead of any repack
+    if (installed) {
+        error = retain_shared_version(shared_path, target_path, installed);
+    }
+    if (error == 0) {
+        error = open_shared_objects(&shared, shared_path);
+    }
+    if (error == 0) {
+        error = git_remote_create_anonymous(&remote, shared, remote_url);
+    }
+    if (error == 0) {
+        char* refspecs[] = {refspec};
+        git_strarray fetch_refspecs = {refspecs, 1};
+        git_fetch_options fetch_opts = GIT_FETCH_OPTIONS_INIT;
+        fetch_opts.callbacks = *callbacks;
+        fetch_opts.depth = opts->depth;
+        fetch_opts.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+        error = git_remote_fetch(remote, &fetch_refspecs, &fetch_opts, NULL);
+    }
+    if (error == 0) {
+        error = git_reference_name_to_id(out, shared, refname);
+    }
+    if (error == 0) {
+        error = peel_to_commit(out, shared);
+    }
+    // Every install fetches into the store, so this is where the packs pile up
+    if (error == 0) {
+        odb_stats stats;
+        if (maintain_repository(shared, out, opts, &stats, opts->fetch_only || opts->low_priority) < 0) {
+            handle_git_error(-1);
+        }
+    }
+
+    git_remote_free(remote);
+    git_repository_free(shared);
+    return error;
+}
+
+// Creates the repository around the shared store's objects, with the same origin remote a clone would have
+inline int install_from_shared(git_repository** out, const char* remote_url, const char* repo_path, const char* target_path,
+                               const update_channel* channel, const git_remote_callbacks* callbacks, const update_options* opts)
+{
+    *out = NULL;
+    git_repository *repo = NULL;
+    git_remote *origin = NULL;
+    git_reference *ref = NULL;
+    git_oid head_oid;
+
+    int error = fetch_into_shared(&head_oid, opts->shared_objects, remote_url, target_path, NULL, channel, callbacks, opts);
+    if (error < 0) {
+        return error;
+    }
+    error = git_repository_init(&repo, repo_path, opts->staged);
+    if (error == 0) {
+        error = single_branch_remote_cb(&origin, repo, "origin", remote_url, (void*)channel);
+        git_remote_free(origin);
+    }
+    if (error == 0) {
+        error = link_shared_objects(repo, opts->shared_objects);
+    }
+    if (error == 0) {
+        error = git_reference_create(&ref, repo, channel->tracking_ref, &head_oid, 1, "launchpad: shared");
+        git_reference_free(ref);
+    }
+    if (error == 0) {
+        error = git_reference_create(&ref, repo, "refs/heads/main", &head_oid, 1, "launchpad: shared");
+        git_reference_free(ref);
+    }
+    if (error == 0) {
+        error = git_repository_set_head(repo, "refs/heads/main");
+    }
+
+    if (error < 0) {
+        git_repository_free(repo);
+        return error;
+    }
+    *out = repo;
+    return 0;
+}
+
+// A mirror that is switched off should cost a moment, not the system's full connect timeout
+inline void set_mirror_connect_timeout(int enabled)
+{
+    git_libgit2_opts(GIT_OPT_SET_SERVER_CONNECT_TIMEOUT, enabled ? 2000 : 0);
+}
+
+// Creates the repository and fetches the channel's ref alone into it, like a single branch clone,
+// except that a tag can be followed as well. The working tree is left for the caller to write
+inline int clone_channel(git_repository** out, const char* remote_url, const char* repo_path, const update_channel* channel,
+                         const git_remote_callbacks* callbacks, const update_options* opts)
+{
+    *out = NULL;
+    git_repository *repo = NULL;
+    git_remote *origin = NULL;
+    git_reference *ref = NULL;
+    git_oid head_oid;
+
+    int error = git_repository_init(&repo, repo_path, opts->staged);
+    if (error == 0) {
+        error = single_branch_remote_cb(&origin, repo, "origin", remote_url, (void*)channel);
+    }
+    if (error == 0) {
+        git_fetch_options fetch_opts = GIT_FETCH_OPTIONS_INIT;
+        fetch_opts.callbacks = *callbacks;
+        fetch_opts.depth = opts->depth;
+        fetch_opts.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+        error = git_remote_fetch(origin, NULL, &fetch_opts, NULL);
+    }
+    if (error == 0) {
+        error = git_reference_name_to_id(&head_oid, repo, channel->tracking_ref);
+    }
+    if (error == 0) {
+        error = peel_to_commit(&head_oid, repo);
+    }
+    if (error == 0) {
+        error = git_reference_create(&ref, repo, "refs/heads/main", &head_oid, 1, "launchpad: clone");
+        git_reference_free(ref);
+    }
+    if (error == 0) {
+        error = git_repository_set_head(repo, "refs/heads/main");
+    }
+    git_remote_free(origin);
+
+    if (error < 0) {
+        git_repository_free(repo);
+        return error;
+    }
+    *out = repo;
+    return 0;
+}
+
+// Fetches the channel's ref from the first mirror that has it at expected. Objects are addressed
+// by their hashes, so a mirror can be behind but it can't hand out a different release
+inline int fetch_from_mirrors(git_oid* out, git_repository* repo, const git_oid* expected, const update_channel* channel,
+                              const git_remote_callbacks* callbacks, const update_options* opts)
+{
+    int error = GIT_ENOTFOUND;
+    if (!opts->in_batch) {
+        set_mirror_connect_timeout(1);
+    }
+    for (size_t i = 0; i < opts->mirror_url_count; i++) {
+        git_remote *remote = NULL;
+        git_oid fetched;
+        memset(&fetched, 0, sizeof(fetched));
+
+        error = git_remote_create_anonymous(&remote, repo, opts->mirror_urls[i]);
+        if (error == 0) {
+            git_fetch_options fetch_opts = GIT_FETCH_OPTIONS_INIT;
+            fetch_opts.callbacks = *callbacks;
+            fetch_opts.depth = opts->depth;
+            fetch_opts.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+            char* refspecs[] = {(char*)channel->refspec};
+            git_strarray fetch_refspecs = {refspecs, 1};
+            error = git_remote_fetch(remote, &fetch_refspecs, &fetch_opts, NULL);
+        }
+        if (error == 0) {
+            git_repository_fetchhead_foreach(repo, fetchhead_cb, &fetched);
+            error = peel_to_commit(&fetched, repo);
+        }
+        if (error == 0) {
+            if (!git_oid_equal(&fetched, expected)) {
+                git_error_set_str(GIT_ERROR_INVALID, "mirror does not have the latest release yet");
+                error = -1;
+            }
+        }
+        git_remote_free(remote);
+
+        if (error == 0) {
+            printf("Fetched update from %s\n", opts->mirror_urls[i]);
+            git_oid_cpy(out, &fetched);
+            break;
+        }
+        handle_git_error(error);
+    }
+    if (!opts->in_batch) {
+        set_mirror_connect_timeout(0);
+    }
+    return error;
+}
+
+// Clones from the first mirror with the commit the channel points to on remote_url, then
+// points origin back at remote_url. The working tree is left for the caller to write
+inline int install_from_mirrors(git_repository** out, const char* remote_url, const char* repo_path, const update_channel* channel,
+                                const git_remote_callbacks* callbacks, const update_options* opts)
+{
+    *out = NULL;
+    git_remote *origin = NULL;
+    git_oid expected, head_oid;
+    int error = git_remote_create_detached(&origin, remote_url);
+    if (error == 0) {
+        error = remote_head_oid(&expected, origin, callbacks, channel->remote_ref);
+    }
+    git_remote_free(origin);
+    if (error < 0) {
+        return error;
+    }
+
+    if (!opts->in_batch) {
+        set_mirror_connect_timeout(1);
+    }
+    for (size_t i = 0; i < opts->mirror_url_count; i++) {
+        git_repository *repo = NULL;
+        error = clone_channel(&repo, opts->mirror_urls[i], repo_path, channel, callbacks, opts);
+        if (error == 0) {
+            error = git_reference_name_to_id(&head_oid, repo, "HEAD");
+        }
+        if (error == 0 && !git_oid_equal(&head_oid, &expected)) {
+            git_error_set_str(GIT_ERROR_INVALID, "mirror does not have the latest release yet");
+            error = -1;
+        }
+        if (error == 0) {
+            error = git_remote_set_url(repo, "origin", remote_url);
+        }
+        if (error == 0) {
+            printf("Downloaded app from %s\n", opts->mirror_urls[i]);
+            *out = repo;
+            break;
+        }
+        handle_git_error(error);
+        git_repository_free(repo);
+        remove_tree(repo_path);
+    }
+    if (!opts->in_batch) {
+        set_mirror_connect_timeout(0);
+    }
+    return error;
+}
+
+// Serves the repository at repo_path read-only over git:// on port, so others on the network
+// can list this machine in mirror_urls as git://<host>:<port>/<name of repo_path>.
+// Returns the pid of the git daemon, or -1 if it could not be started
+inline pid_t serve_mirror(const char* repo_path, int port)
+{
+    char path[PATH_MAX], base_arg[PATH_MAX + 16], port_arg[32];
+    absolute_path(path, sizeof(path), repo_path);
+    char* name = strrchr(path, '/');
+    *name = '\0';
+    snprintf(base_arg, sizeof(base_arg), "--base-path=%s", path);
+    snprintf(port_arg, sizeof(port_arg), "--port=%d", port);
+    *name = '/';
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+#ifdef __linux__
+        // The launcher becomes the client, so this goes away when the client does
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        // Listing the path serves only this repository, whatever else sits beside it
+        execlp("git", "git", "daemon", "--reuseaddr", "--export-all", port_arg, base_arg, path, (char*)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Decodes base64, skipping whitespace. Returns the decoded length, or 0 if it isn't base64
+inline size_t base64_decode(unsigned char* out, size_t out_size, const char* in, size_t in_len)
+{
+    char* packed = (char*)malloc(in_len + 1);
+    size_t len = 0, padding = 0;
+    for (size_t i = 0; i < in_len; i++) {
+        if (in[i] != '\n' && in[i] != '\r' && in[i] != ' ' && in[i] != '\t') {
+            packed[len++] = in[i];
+        }
+    }
+    packed[len] = '\0';
+    if (len == 0 || len % 4 != 0 || len / 4 * 3 > out_size) {
+        free(packed);
+        return 0;
+    }
+    padding = (packed[len - 1] == '=') + (packed[len - 2] == '=');
+    int decoded = EVP_DecodeBlock(out, (const unsigned char*)packed, (int)len);
+    free(packed);
+    return decoded < 0 ? 0 : (size_t)decoded - padding;
+}
+
+// Reads an SSH wire format string, a big endian length then the bytes, at *pos
+inline int ssh_read_string(const unsigned char** out, size_t* out_len, const unsigned char* buf, size_t len, size_t* pos)
+{
+    if (len - *pos < 4) {
+        return -1;
+    }
+    size_t str_len = ((size_t)buf[*pos] << 24) | ((size_t)buf[*pos + 1] << 16) | ((size_t)buf[*pos + 2] << 8) | buf[*pos + 3];
+    *pos += 4;
+    if (len - *pos < str_len) {
+        return -1;
+    }
+    *out = buf + *pos;
+    *out_len = str_len;
+    *pos += str_len;
+    return 0;
+}
+
+inline int ssh_string_equals(const unsigned char* str, size_t len, const char* expected)
+{
+    return len == strlen(expected) && memcmp(str, expected, len) == 0;
+}
+
+inline void ssh_write_string(unsigned char* out, size_t* pos, const unsigned char* str, size_t len)
+{
+    out[(*pos)++] = (unsigned char)(len >> 24);
+    out[(*pos)++] = (unsigned char)(len >> 16);
+    out[(*pos)++] = (unsigned char)(len >> 8);
+    out[(*pos)++] = (unsigned char)len;
+    memcpy(out + *pos, str, len);
+    *pos += len;
+}
+
+// Takes the raw 32 byte key out of an ssh-ed25519 public key blob
+inline int ssh_ed25519_key(const unsigned char** out, const unsigned char* blob, size_t len)
+{
+    const unsigned char *type, *key;
+    size_t type_len, key_len, pos = 0;
+    if (ssh_read_string(&type, &type_len, blob, len, &pos) < 0 || !ssh_string_equals(type, type_len, "ssh-ed25519") ||
+        ssh_read_string(&key, &key_len, blob, len, &pos) < 0 || key_len != 32) {
+        return -1;
+    }
+    *out = key;
+    return 0;
+}
+
+// Whether key is one of the trusted_keys, given as "ssh-ed25519 <base64> [comment]"
+inline int ssh_key_trusted(const unsigned char* key, const char* const* trusted_keys, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const char* line = trusted_keys[i];
+        if (strncmp(line, "ssh-ed25519 ", 12) != 0) {
+            continue;
+        }
+        line += 12;
+        unsigned char blob[128];
+        const unsigned char* trusted;
+        size_t len = base64_decode(blob, sizeof(blob), line, strcspn(line, " \n"));
+        if (len > 0 && ssh_ed25519_key(&trusted, blob, len) == 0 && memcmp(trusted, key, 32) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Checks an armored SSHSIG signature, as ssh-keygen -Y sign -n git makes, over data.
+// One hash of the data and one ed25519 verification, so it takes microseconds
+inline int verify_ssh_signature(const char* armored, const char* data, size_t data_len, const char* const* trusted_keys, size_t count)
+{
+    static const char begin[] = "-----BEGIN SSH SIGNATURE-----", end[] = "-----END SSH SIGNATURE-----";
+    const char* start = strstr(armored, begin);
+    const char* stop = start ? strstr(start, end) : NULL;
+    if (!stop) {
+        git_error_set_str(GIT_ERROR_INVALID, "release is not signed with an SSH key");
+        return -1;
+    }
+    start += sizeof(begin) - 1;
+
+    unsigned char sig[1024];
+    size_t sig_len = base64_decode(sig, sizeof(sig), start, (size_t)(stop - start));
+    const unsigned char *public_key, *name_space, *reserved, *hash_algorithm, *signature, *key, *type, *raw;
+    size_t public_key_len, name_space_len, reserved_len, hash_algorithm_len, signature_len, type_len, raw_len;
+    size_t pos = 10;
+    if (sig_len < 10 || memcmp(sig, "SSHSIG\0\0\0\1", 10) != 0 ||
+        ssh_read_string(&public_key, &public_key_len, sig, sig_len, &pos) < 0 ||
+        ssh_read_string(&name_space, &name_space_len, sig, sig_len, &pos) < 0 ||
+        ssh_read_string(&reserved, &reserved_len, sig, sig_len, &pos) < 0 ||
+        ssh_read_string(&hash_algorithm, &hash_algorithm_len, sig, sig_len, &pos) < 0 ||
+        ssh_read_string(&signature, &signature_len, sig, sig_len, &pos) < 0) {
+        git_error_set_str(GIT_ERROR_INVALID, "malformed SSH signature");
+        return -1;
+    }
+    if (ssh_ed25519_key(&key, public_key, public_key_len) < 0 || !ssh_key_trusted(key, trusted_keys, count)) {
+        git_error_set_str(GIT_ERROR_INVALID, "release is not signed by a trusted key");
+        return -1;
+    }
+    pos = 0;
+    if (!ssh_string_equals(name_space, name_space_len, "git") ||
+        ssh_read_string(&type, &type_len, signature, signature_len, &pos) < 0 || !ssh_string_equals(type, type_len, "ssh-ed25519") ||
+        ssh_read_string(&raw, &raw_len, signature, signature_len, &pos) < 0 || raw_len != 64) {
+        git_error_set_str(GIT_ERROR_INVALID, "unsupported SSH signature");
+        return -1;
+    }
+
+    // What was signed is the magic, the namespace, reserved, the hash algorithm and the data's hash
+    const EVP_MD* md = ssh_string_equals(hash_algorithm, hash_algorithm_len, "sha512") ? EVP_sha512() :
+                       ssh_string_equals(hash_algorithm, hash_algorithm_len, "sha256") ? EVP_sha256() : NULL;
+    unsigned char digest[EVP_MAX_MD_SIZE], message[256];
+    unsigned int digest_len = 0;
+    if (!md || name_space_len + reserved_len + hash_algorithm_len + EVP_MAX_MD_SIZE + 22 > sizeof(message) ||
+        !EVP_Digest(data, data_len, digest, &digest_len, md, NULL)) {
+        git_error_set_str(GIT_ERROR_INVALID, "unsupported SSH signature hash");
+        return -1;
+    }
+    size_t message_len = 6;
+    memcpy(message, "SSHSIG", 6);
+    ssh_write_string(message, &message_len, name_space, name_space_len);
+    ssh_write_string(message, &message_len, reserved, reserved_len);
+    ssh_write_string(message, &message_len, hash_algorithm, hash_algorithm_len);
+    ssh_write_string(message, &message_len, digest, digest_len);
+
+    EVP_PKEY* pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, key, 32);
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    int valid = pkey && ctx && EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+                EVP_DigestVerify(ctx, raw, raw_len, message, message_len) == 1;
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+    if (!valid) {
+        git_error_set_str(GIT_ERROR_INVALID, "release signature does not match");
+        return -1;
+    }
+    return 0;
+}
+
+// Checks the commit's signature against opts' trusted keys. The commit names its tree by hash,
+// and every tree names its entries by hash, so this covers every file without reading one
+inline int verify_release(git_repository* repo, const git_oid* oid, const update_options* opts)
+{
+    git_buf signature = GIT_BUF_INIT, signed_data = GIT_BUF_INIT;
+    int error = git_commit_extract_signature(&signature, &signed_data, repo, (git_oid*)oid, NULL);
+    if (error == GIT_ENOTFOUND) {
+        git_error_set_str(GIT_ERROR_INVALID, "release is not signed");
+        error = -1;
+    }
+    if (error == 0) {
+        error = verify_ssh_signature(signature.ptr, signed_data.ptr, signed_data.size, opts->trusted_keys, opts->trusted_key_count);
+    }
+    git_buf_dispose(&signature);
+    git_buf_dispose(&signed_data);
+    return error;
+}
+
+inline int apply_memory_limits(const update_options* opts)
+{
+    int error = 0;
+    if (error == 0 && opts->mwindow_size > 0) {
+        error = git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, opts->mwindow_size);
+    }
+    if (error == 0 && opts->mwindow_mapped_limit > 0) {
+        error = git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, opts->mwindow_mapped_limit);
+    }
+    if (error == 0 && opts->cache_max_size > 0) {
+        error = git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (ssize_t)opts->cache_max_size);
+    }
+    return error;
+}
+
+// Drops the calling process to idle CPU and I/O priority, so it only uses what the client leaves
+inline void lower_priority(void)
+{
+    setpriority(PRIO_PROCESS, 0, 19);
+#ifdef __linux__
+    // IOPRIO_WHO_PROCESS with IOPRIO_CLASS_IDLE, glibc has no wrapper for ioprio_set
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+}
+
+// Transfer progress as plain counters. Callbacks only store into them, so they cost next to
+// nothing however often libgit2 calls, and whoever shows progress samples them at its own pace
+typedef struct update_progress {
+    unsigned int received_objects;
+    unsigned int total_objects;
+    unsigned int indexed_objects;
+    unsigned int indexed_deltas;
+    unsigned int total_deltas;
+    size_t received_bytes;
+} update_progress;
+
+// A transfer_progress callback that keeps the update_progress passed as its payload current
+inline int update_progress_cb(const git_indexer_progress *stats, void *payload)
+{
+    update_progress* progress = (update_progress*)payload;
+    __atomic_store_n(&progress->received_objects, stats->received_objects, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->total_objects, stats->total_objects, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->indexed_objects, stats->indexed_objects, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->indexed_deltas, stats->indexed_deltas, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->total_deltas, stats->total_deltas, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->received_bytes, stats->received_bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Adds up the counters of several transfers
+inline void update_progress_sum(update_progress* out, const update_progress* progress, size_t count)
+{
+    memset(out, 0, sizeof(*out));
+    for (size_t i = 0; i < count; i++) {
+        out->received_objects += __atomic_load_n(&progress[i].received_objects, __ATOMIC_RELAXED);
+        out->total_objects += __atomic_load_n(&progress[i].total_objects, __ATOMIC_RELAXED);
+        out->indexed_objects += __atomic_load_n(&progress[i].indexed_objects, __ATOMIC_RELAXED);
+        out->indexed_deltas += __atomic_load_n(&progress[i].indexed_deltas, __ATOMIC_RELAXED);
+        out->total_deltas += __atomic_load_n(&progress[i].total_deltas, __ATOMIC_RELAXED);
+        out->received_bytes += __atomic_load_n(&progress[i].received_bytes, __ATOMIC_RELAXED);
+    }
+}
+
+// Prints the counters of one or more transfers on a thread of its own, a few times a second
+// and only when they changed, along with the latest message from the server
+typedef struct progress_renderer {
+    const update_progress* counters;
+    size_t count;
+    int interval_ms;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running;
+    int stop;
+    int printed;
+    update_progress shown;
+    char message[256];
+    int message_pending;
+} progress_renderer;
+
+// Prints whatever changed since the last call, with the lock held
+inline void progress_render(progress_renderer* renderer)
+{
+    int changed = 0;
+    if (renderer->message_pending) {
+        printf("remote: %s", renderer->message);
+        renderer->message_pending = 0;
+        changed = 1;
+    }
+
+    update_progress now;
+    update_progress_sum(&now, renderer->counters, renderer->count);
+    if (memcmp(&now, &renderer->shown, sizeof(now)) != 0) {
+        renderer->shown = now;
+        if (renderer->count > 1) {
+            printf("Updating %zu repositories: %u/%u objects in %zu bytes\r",
+                   renderer->count, now.received_objects, now.total_objects, now.received_bytes);
+        } else if (now.total_objects > 0 && now.received_objects == now.total_objects) {
+            printf("Resolving deltas %u/%u\r", now.indexed_deltas, now.total_deltas);
+        } else if (now.total_objects > 0) {
+            printf("Received %u/%u objects (%u) in %zu bytes\r",
+                   now.received_objects, now.total_objects, now.indexed_objects, now.received_bytes);
+        }
+        changed = 1;
+    }
+    if (changed) {
+        renderer->printed = 1;
+        fflush(stdout);
+    }
+}
+
+inline void* progress_renderer_worker(void* payload)
+{
+    progress_renderer* renderer = (progress_renderer*)payload;
+    pthread_mutex_lock(&renderer->lock);
+    while (!renderer->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)renderer->interval_ms * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&renderer->wake, &renderer->lock, &deadline);
+        progress_render(renderer);
+    }
+    pthread_mutex_unlock(&renderer->lock);
+    return NULL;
+}
+
+// Starts printing counters, count of them, hz times a second. Without a thread it prints once, when stopped
+inline void progress_renderer_start(progress_renderer* renderer, const update_progress* counters, size_t count, int hz)
+{
+    memset(renderer, 0, sizeof(*renderer));
+    renderer->counters = counters;
+    renderer->count = count;
+    renderer->interval_ms = hz > 0 ? 1000 / hz : 100;
+    pthread_mutex_init(&renderer->lock, NULL);
+    pthread_cond_init(&renderer->wake, NULL);
+    renderer->running = pthread_create(&renderer->thread, NULL, progress_renderer_worker, renderer) == 0;
+}
+
+// A remote_message callback for a renderer: keeps the latest line for its next frame
+inline int progress_renderer_message_cb(const char *str, int len, void *payload)
+{
+    progress_renderer* renderer = (progress_renderer*)payload;
+    pthread_mutex_lock(&renderer->lock);
+    snprintf(renderer->message, sizeof(renderer->message), "%.*s", len, str);
+    renderer->message_pending = 1;
+    pthread_mutex_unlock(&renderer->lock);
+    return 0;
+}
+
+// Prints the final state and ends the line, then stops the thread
+inline void progress_renderer_stop(progress_renderer* renderer)
+{
+    pthread_mutex_lock(&renderer->lock);
+    renderer->stop = 1;
+    pthread_cond_signal(&renderer->wake);
+    pthread_mutex_unlock(&renderer->lock);
+    if (renderer->running) {
+        pthread_join(renderer->thread, NULL);
+    }
+    progress_render(renderer);
+    if (renderer->printed) {
+        printf("\n");
+    }
+    pthread_cond_destroy(&renderer->wake);
+    pthread_mutex_destroy(&renderer->lock);
+}
+
+// Phases of an update, timed with a monotonic clock
+typedef enum update_phase {
+    UPDATE_PHASE_INIT,
+    UPDATE_PHASE_OPEN,
+    UPDATE_PHASE_REMOTE_CREATE,
+    UPDATE_PHASE_CONNECT,
+    UPDATE_PHASE_NEGOTIATION,
+    UPDATE_PHASE_PACK_RECEIVE,
+    UPDATE_PHASE_DELTA_RESOLVE,
+    UPDATE_PHASE_MERGE_ANALYSIS,
+    UPDATE_PHASE_CHECKOUT,
+    UPDATE_PHASE_MAINTENANCE,
+    // Set by the caller: from the start of the update until the client is started
+    UPDATE_PHASE_LAUNCH,
+    UPDATE_PHASE_COUNT
+} update_phase;
+
+inline const char* update_phase_name(int phase)
+{
+    static const char* const names[UPDATE_PHASE_COUNT] = {
+        "init", "open", "remote_create", "connect", "negotiation", "pack_receive",
+        "delta_resolve", "merge_analysis", "checkout", "maintenance", "launch"
+    };
+    return names[phase];
+}
+
+// Where one run of update_from_repo spent its time
+typedef struct update_timings {
+    double seconds[UPDATE_PHASE_COUNT];
+    double started;
+    size_t received_bytes;
+    unsigned int received_objects;
+    // The object database after the update, to show it isn't growing without bound
+    odb_stats odb;
+    // The process's peak resident set in KiB, and the phase it was reached in
+    long peak_rss_kb;
+    int peak_rss_phase;
+    // One of "skipped", "up_to_date", "downloaded", "updated", "installed" or "failed",
+    // or "background" when the caller left the update to update_in_background
+    const char* result;
+} update_timings;
+
+inline double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Appends the timings to path as one JSON object per line. Once path reaches max_bytes it is
+// moved to <path>.1, replacing the one before, so the log never takes more than twice that.
+// 0 lets it grow
+inline int write_update_timings(const update_timings* timings, const char* path, size_t max_bytes)
+{
+    struct stat st;
+    if (max_bytes > 0 && stat(path, &st) == 0 && (size_t)st.st_size >= max_bytes) {
+        char rotated[PATH_MAX];
+        snprintf(rotated, sizeof(rotated), "%s.1", path);
+        rename(path, rotated);
+    }
+    FILE* file = fopen(path, "a");
+    if (!file) {
+        return os_error(path);
+    }
+    fprintf(file, "{\"time\":%lld,\"result\":\"%s\"", (long long)time(NULL), timings->result ? timings->result : "failed");
+    for (int i = 0; i < UPDATE_PHASE_COUNT; i++) {
+        fprintf(file, ",\"%s\":%.6f", update_phase_name(i), timings->seconds[i]);
+    }
+    fprintf(file, ",\"received_bytes\":%zu,\"received_objects\":%u", timings->received_bytes, timings->received_objects);
+    fprintf(file, ",\"packs\":%d,\"pack_bytes\":%zu,\"loose_objects\":%d",
+            timings->odb.packs, timings->odb.pack_bytes, timings->odb.loose_objects);
+    fprintf(file, ",\"peak_rss_kb\":%ld,\"peak_rss_phase\":\"%s\"}\n", timings->peak_rss_kb, update_phase_name(timings->peak_rss_phase));
+    fclose(file);
+    return 0;
+}
+
+// Splits a transfer into negotiation, pack receive and delta resolve from its
+// progress callbacks, and passes them on to the real progress callback.
+// libgit2 calls it from its receive loop, so it is also where a transfer is throttled
+typedef struct timing_progress {
+    update_timings* timings;
+    git_indexer_progress_cb forward;
+    void* forward_payload;
+    int phase;
+    double phase_started;
+    double started;
+    const update_options* opts;
+    // Prints server messages when opts has no remote_message
+    progress_renderer* renderer;
+} timing_progress;
+
+inline void report_phase(const update_options* opts, update_timings* timings, int phase, double seconds)
+{
+    timings->seconds[phase] += seconds;
+    // The high-water mark only rises, so the phase that raised it last is where memory peaked
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0 && usage.ru_maxrss > timings->peak_rss_kb) {
+        timings->peak_rss_kb = usage.ru_maxrss;
+        timings->peak_rss_phase = phase;
+    }
+    if (opts->phase_done) {
+        opts->phase_done(phase, seconds, opts->progress_payload);
+    }
+}
+
+inline int timing_progress_cb(const git_indexer_progress *stats, void *payload)
+{
+    timing_progress* transfer = (timing_progress*)payload;
+    const update_options* opts = transfer->opts;
+    if (cancel_requested(opts->cancel)) {
+        return cancelled_error();
+    }
+
+    int phase = stats->total_objects > 0 && stats->received_objects == stats->total_objects ?
+        UPDATE_PHASE_DELTA_RESOLVE : UPDATE_PHASE_PACK_RECEIVE;
+    if (phase > transfer->phase) {
+        double now = monotonic_seconds();
+        report_phase(opts, transfer->timings, transfer->phase, now - transfer->phase_started);
+        transfer->phase = phase;
+        transfer->phase_started = now;
+    }
+    transfer->timings->received_bytes = stats->received_bytes;
+    transfer->timings->received_objects = stats->received_objects;
+
+    // Sleeping here stops libgit2 reading the socket, which lets TCP slow the sender down
+    if (opts->max_bytes_per_second > 0) {
+        double due = transfer->started + (double)stats->received_bytes / (double)opts->max_bytes_per_second;
+        double ahead = due - monotonic_seconds();
+        if (ahead > 0) {
+            usleep((useconds_t)((ahead < 1.0 ? ahead : 1.0) * 1e6));
+        }
+    }
+    return transfer->forward(stats, transfer->forward_payload);
+}
+
+// The server's messages arrive while it is still counting objects, long before any pack data
+inline int timing_message_cb(const char *str, int len, void *payload)
+{
+    const update_options* opts = ((timing_progress*)payload)->opts;
+    if (cancel_requested(opts->cancel)) {
+        return cancelled_error();
+    }
+    if (opts->remote_message) {
+        return opts->remote_message(str, len, opts->progress_payload);
+    }
+    if (((timing_progress*)payload)->renderer) {
+        return progress_renderer_message_cb(str, len, ((timing_progress*)payload)->renderer);
+    }
+    return progress_cb(str, len, NULL);
+}
+
+// For the transfers libgit2 doesn't make: curl paces itself and a bundle on disk needs no
+// pacing, so this only checks for cancellation and counts
+inline int local_progress_cb(const git_indexer_progress *stats, void *payload)
+{
+    timing_progress* transfer = (timing_progress*)payload;
+    if (cancel_requested(transfer->opts->cancel)) {
+        return cancelled_error();
+    }
+    transfer->timings->received_bytes = stats->received_bytes;
+    transfer->timings->received_objects = stats->received_objects;
+    return transfer->forward(stats, transfer->forward_payload);
+}
+
+inline void timing_progress_begin(timing_progress* transfer)
+{
+    transfer->phase = UPDATE_PHASE_NEGOTIATION;
+    transfer->phase_started = transfer->started = monotonic_seconds();
+}
+
+inline void timing_progress_end(timing_progress* transfer)
+{
+    report_phase(transfer->opts, transfer->timings, transfer->phase, monotonic_seconds() - transfer->phase_started);
+}
+
+// Everything one run of update_from_repo works with
+typedef struct update_context {
+    const char* remote_url;
+    const char* target_path;
+    const update_options* opts;
+    // In staged mode the repository is bare and target_path is a link to the active version
+    char repo_path[PATH_MAX];
+    checkout_plan plan;
+    git_remote_callbacks callbacks;
+    timing_progress transfer;
+    update_timings* timings;
+    update_channel channel;
+    // Without a transfer_progress callback, progress is counted here and printed by the renderer
+    update_progress progress;
+    progress_renderer renderer;
+    // Zero unless a release was rolled back here
+    git_oid rejected;
+} update_context;
+
+inline void phase_done(update_context* ctx, update_phase phase, double started)
+{
+    report_phase(ctx->opts, ctx->timings, phase, monotonic_seconds() - started);
+}
+
+// Brings an existing install up to date. probed says whether remote_oid already holds the remote head
+inline int update_existing(update_context* ctx, int probed, git_oid* remote_oid)
+{
+    const update_options* opts = ctx->opts;
+    git_repository *repo = NULL;
+    git_remote *remote = NULL;
+    git_oid head_oid, oid;
+    int error = 0;
+
+    // Open the local repository
+    double started = monotonic_seconds();
+    error = git_repository_open(&repo, ctx->repo_path);
+    phase_done(ctx, UPDATE_PHASE_OPEN, started);
+    if (error < 0) {
+        printf("Directory is not a repository!\n");
+        return error;
+    }
+
+    // Create an anonymous remote
+    started = monotonic_seconds();
+    error = git_remote_create_anonymous(&remote, repo, ctx->remote_url);
+    phase_done(ctx, UPDATE_PHASE_REMOTE_CREATE, started);
+    if (error < 0) {
+        handle_git_error(error);
+        goto cleanup;
+    }
+
+    if (!probed) {
+        printf("Checking for updates\n");
+    }
+
+    // Most launches have nothing to do, so compare heads before paying for a fetch
+    {
+        int have_head = git_reference_name_to_id(&head_oid, repo, "HEAD") == 0;
+        if (have_head && !probed) {
+            started = monotonic_seconds();
+            error = remote_head_oid(remote_oid, remote, &ctx->callbacks, ctx->channel.remote_ref);
+            phase_done(ctx, UPDATE_PHASE_CONNECT, started);
+            if (error < 0) {
+                handle_git_error(error);
+                goto cleanup;
+            }
+            probed = 1;
+        }
+        if (have_head && probed && git_oid_equal(remote_oid, &head_oid)) {
+            printf("Already up to date\n");
+            record_update_state(ctx->target_path, ctx->remote_url, &head_oid, remote_oid);
+            ctx->timings->result = "up_to_date";
+            goto cleanup;
+        }
+
+        // A patch between releases is the smallest download, then a release bundle,
+        // which can be resumed if the connection drops, where a fetch always starts over
+        int fetched = 0;
+        timing_progress_begin(&ctx->transfer);
+        // A fetch only run may have downloaded it already, then there is only the switch left
+        if (probed && have_commit_and_tree(repo, remote_oid)) {
+            git_oid_cpy(&oid, remote_oid);
+            fetched = 1;
+        }
+        // Another machine in the building is cheaper than any of them
+        if (!fetched && probed && opts->mirror_url_count > 0) {
+            fetched = fetch_from_mirrors(&oid, repo, remote_oid, &ctx->channel, &ctx->callbacks, opts) == 0;
+        }
+        if (!fetched && probed && have_head && opts->patch_url) {
+            error = fetch_update_patch(repo, opts->patch_url, ctx->target_path, &ctx->channel, &head_oid, remote_oid,
+                                       opts->max_bytes_per_second, &local_progress_cb, &ctx->transfer);
+            if (error < 0) {
+                handle_git_error(error);
+                printf("No usable patch for this update\n");
+            } else {
+                git_oid_cpy(&oid, remote_oid);
+                fetched = 1;
+            }
+        }
+        if (!fetched && probed && opts->update_bundle_url) {
+            error = fetch_update_bundle(repo, opts->update_bundle_url, ctx->target_path, &ctx->channel, remote_oid,
+                                        opts->max_bytes_per_second, &local_progress_cb, &ctx->transfer);
+            if (error < 0) {
+                handle_git_error(error);
+                printf("Falling back to a fetch\n");
+            } else {
+                git_oid_cpy(&oid, remote_oid);
+                fetched = 1;
+            }
+        }
+
+        if (!fetched && opts->shared_objects) {
+            error = fetch_into_shared(&oid, opts->shared_objects, ctx->remote_url, ctx->target_path, have_head ? &head_oid : NULL,
+                                      &ctx->channel, &ctx->callbacks, opts);
+            if (error == 0) {
+                error = link_shared_objects(repo, opts->shared_objects);
+            }
+            if (error < 0) {
+                handle_git_error(error);
+                printf("Falling back to a fetch of this install's own\n");
+            } else {
+                fetched = 1;
+            }
+        }
+
+        // Fetch, over the probe's connection if it used this remote
+        if (!fetched) {
+            git_fetch_options fetch_opts = GIT_FETCH_OPTIONS_INIT;
+            fetch_opts.callbacks = ctx->callbacks;
+            // Keep a shallow clone shallow
+            fetch_opts.depth = opts->depth;
+            // Only the channel's tip, whatever other branches and tags the remote has
+            fetch_opts.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+            char* refspecs[] = {ctx->channel.refspec};
+            git_strarray fetch_refspecs = {refspecs, 1};
+
+            error = git_remote_fetch(remote, &fetch_refspecs, &fetch_opts, NULL);
+            if (error == 0) {
+                git_repository_fetchhead_foreach(repo, fetchhead_cb, &oid);
+                error = peel_to_commit(&oid, repo);
+            }
+            if (error < 0) {
+                timing_progress_end(&ctx->transfer);
+                handle_git_error(error);
+                goto cleanup;
+            }
+        }
+        timing_progress_end(&ctx->transfer);
+    }
+
+    // Wherever its objects came from, nothing is written for a release that isn't ours
+    if (opts->trusted_key_count > 0) {
+        error = verify_release(repo, &oid, opts);
+        if (error < 0) {
+            handle_git_error(error);
+            goto cleanup;
+        }
+    }
+
+    if (git_oid_equal(&oid, &ctx->rejected)) {
+        printf("This release was rolled back, staying on the current version\n");
+        if (git_reference_name_to_id(&head_oid, repo, "HEAD") == 0) {
+            record_update_state(ctx->target_path, ctx->remote_url, &head_oid, &head_oid);
+        }
+        ctx->timings->result = "rejected";
+        goto cleanup;
+    }
+
+    // Any release other than HEAD is applied, including an older one: a channel pinned to an
+    // earlier tag or a branch moved back is an ancestor, which merge analysis calls up to date
+    started = monotonic_seconds();
+    {
+        git_commit *target = NULL;
+        error = git_commit_lookup(&target, repo, &oid);
+        git_commit_free(target);
+        int current = git_reference_name_to_id(&head_oid, repo, "HEAD") == 0 && git_oid_equal(&head_oid, &oid);
+        phase_done(ctx, UPDATE_PHASE_MERGE_ANALYSIS, started);
+        if (error < 0) {
+            handle_git_error(error);
+            goto cleanup;
+        }
+
+        // Check if update is needed
+        started = monotonic_seconds();
+        if (current) {
+            printf("Already up to date\n");
+            ctx->timings->result = "up_to_date";
+        } else if (opts->fetch_only) {
+            // Staging is safe while the client runs, switching to it waits for the next launch
+            if (opts->staged) {
+                error = stage_version(repo, &oid, ctx->target_path, &ctx->plan);
+            }
+            if (error == 0) {
+                printf("Update downloaded, it will be applied on the next launch\n");
+                ctx->timings->result = "downloaded";
+            }
+        } else if (opts->staged) {
+            printf("Applying update\n");
+            error = apply_staged(repo, &oid, ctx->target_path, &ctx->plan);
+            ctx->timings->result = "updated";
+        } else {
+            // The client never changes its own files, so this only moves the branch and the diff
+            printf("Applying update\n");
+            error = apply_changed_paths(repo, &oid, &ctx->plan);
+            ctx->timings->result = "updated";
+        }
+        phase_done(ctx, UPDATE_PHASE_CHECKOUT, started);
+        if (error < 0) {
+            handle_git_error(error);
+            ctx->timings->result = "failed";
+            goto cleanup;
+        }
+    }
+
+    // The working tree now matches HEAD, which only moved if the update was applied
+    if (git_reference_name_to_id(&head_oid, repo, "HEAD") == 0) {
+        record_update_state(ctx->target_path, ctx->remote_url, &head_oid, &oid);
+        if (opts->shared_objects && retain_shared_version(opts->shared_objects, ctx->target_path, &head_oid) < 0) {
+            handle_git_error(-1);
+        }
+    }
+
+    // Every fetch adds a pack, fold them back together before they slow the next launch down.
+    // Only runs nobody waits on repack here
+    started = monotonic_seconds();
+    if (maintain_repository(repo, &oid, opts, &ctx->timings->odb, opts->fetch_only || opts->low_priority) < 0) {
+        handle_git_error(-1);
+    }
+    phase_done(ctx, UPDATE_PHASE_MAINTENANCE, started);
+
+cleanup:
+    git_remote_free(remote);
+    git_repository_free(repo);
+    return error;
+}
+
+// First time launching, so download the application
+inline int install_fresh(update_context* ctx)
+{
+    const update_options* opts = ctx->opts;
+    printf("Downloading app\n");
+
+    // A bundle comes from static hosting instead of making the git server build a pack
+    git_repository *repo = NULL;
+    int error = -1;
+    timing_progress_begin(&ctx->transfer);
+    if (opts->mirror_url_count > 0) {
+        error = install_from_mirrors(&repo, ctx->remote_url, ctx->repo_path, &ctx->channel, &ctx->callbacks, opts);
+        if (error < 0) {
+            printf("No mirror has the app, downloading it from the server\n");
+        }
+    }
+    if (error < 0 && opts->bundle_url) {
+        error = install_from_bundle(&repo, opts->bundle_url, ctx->remote_url, ctx->repo_path, ctx->target_path, &ctx->channel,
+                                    opts->staged, opts->max_bytes_per_second, &local_progress_cb, &ctx->transfer);
+        if (error < 0) {
+            handle_git_error(error);
+            printf("Falling back to a clone\n");
+            remove_tree(ctx->repo_path);
+        }
+    }
+
+    if (error < 0 && opts->shared_objects) {
+        error = install_from_shared(&repo, ctx->remote_url, ctx->repo_path, ctx->target_path, &ctx->channel, &ctx->callbacks, opts);
+        if (error < 0) {
+            handle_git_error(error);
+            printf("Falling back to a clone\n");
+            remove_tree(ctx->repo_path);
+        }
+    }
+
+    if (error < 0) {
+        error = clone_channel(&repo, ctx->remote_url, ctx->repo_path, &ctx->channel, &ctx->callbacks, opts);
+        if (error < 0) {
+            timing_progress_end(&ctx->transfer);
+            handle_git_error(error);
+            return error;
+        }
+    }
+    timing_progress_end(&ctx->transfer);
+
+    if (opts->trusted_key_count > 0) {
+        git_oid head_oid;
+        error = git_reference_name_to_id(&head_oid, repo, "HEAD");
+        if (error == 0) {
+            error = verify_release(repo, &head_oid, opts);
+        }
+        if (error < 0) {
+            handle_git_error(error);
+            git_repository_free(repo);
+            remove_tree(ctx->repo_path);
+            return error;
+        }
+    }
+
+    double started = monotonic_seconds();
+    if (opts->staged) {
+        git_oid head_oid;
+        error = git_reference_name_to_id(&head_oid, repo, "HEAD");
+        if (error == 0) {
+            error = apply_staged(repo, &head_oid, ctx->target_path, &ctx->plan);
+        }
+    } else {
+        error = checkout_head_tree(repo, &ctx->plan);
+    }
+    phase_done(ctx, UPDATE_PHASE_CHECKOUT, started);
+    if (error < 0) {
+        handle_git_error(error);
+        git_repository_free(repo);
+        return error;
+    }
+
+    git_oid head_oid;
+    if (git_reference_name_to_id(&head_oid, repo, "HEAD") == 0) {
+        record_update_state(ctx->target_path, ctx->remote_url, &head_oid, &head_oid);
+        if (opts->shared_objects && retain_shared_version(opts->shared_objects, ctx->target_path, &head_oid) < 0) {
+            handle_git_error(-1);
+        }
+    }
+    ctx->timings->result = "installed";
+    git_repository_free(repo);
+    return 0;
+}
+
+// Brings target_path to the tip of the channel in opts. A recent check or a probe that finds
+// nothing new returns without fetching. Otherwise the release comes from a mirror, a patch, a
+// release bundle, the shared store or a fetch, is verified when keys are set, and is written
+// as a diff, or staged beside the active version and switched to. A fresh install clones,
+// or starts from a bundle. Returns 0 or a libgit2 error code
+inline int update_from_repo(const char* remote_url, const char* target_path, const update_options* opts)
+{
+    update_options default_opts = UPDATE_OPTIONS_INIT;
+    if (!opts) {
+        opts = &default_opts;
+    }
+
+    update_timings own_timings;
+    update_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.remote_url = remote_url;
+    ctx.target_path = target_path;
+    ctx.opts = opts;
+    ctx.timings = opts->timings ? opts->timings : &own_timings;
+    memset(ctx.timings, 0, sizeof(*ctx.timings));
+    ctx.timings->started = monotonic_seconds();
+    snprintf(ctx.repo_path, sizeof(ctx.repo_path), opts->staged ? "%s.git" : "%s", target_path);
+    channel_init(&ctx.channel, opts->channel);
+
+    double started = ctx.timings->started;
+    update_state state;
+    int have_state = read_update_state(&state, target_path) == 0 && strcmp(state.remote_url, remote_url) == 0 &&
+                     access(target_path, F_OK) == 0 && access(ctx.repo_path, F_OK) == 0;
+    phase_done(&ctx, UPDATE_PHASE_OPEN, started);
+    if (have_state) {
+        git_oid_cpy(&ctx.rejected, &state.rejected);
+    }
+
+    // Inside the interval there is no network I/O at all, unless a downloaded update is waiting to be applied
+    if (have_state && opts->check_interval > 0 && git_oid_equal(&state.applied, &state.remote_head)) {
+        unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+        long long interval = opts->check_interval;
+        if (opts->check_jitter > 0) {
+            interval += rand_r(&seed) % (opts->check_jitter + 1);
+        }
+        long long now = (long long)time(NULL);
+        if (now >= state.checked && now - state.checked < interval) {
+            printf("Checked for updates recently, skipping\n");
+            ctx.timings->result = "skipped";
+            return 0;
+        }
+    }
+
+    if (opts->low_priority) {
+        lower_priority();
+    }
+
+    // Perform git operations
+    started = monotonic_seconds();
+    git_libgit2_init();
+    if (!opts->in_batch && apply_memory_limits(opts) < 0) {
+        handle_git_error(-1);
+    }
+
+    {
+        int error = plan_init(&ctx.plan, opts);
+        if (error < 0) {
+            handle_git_error(error);
+            git_libgit2_shutdown();
+            return error;
+        }
+    }
+
+    ctx.transfer.timings = ctx.timings;
+    if (opts->transfer_progress) {
+        ctx.transfer.forward = opts->transfer_progress;
+        ctx.transfer.forward_payload = opts->progress_payload;
+    } else {
+        ctx.transfer.forward = &update_progress_cb;
+        ctx.transfer.forward_payload = &ctx.progress;
+        ctx.transfer.renderer = &ctx.renderer;
+        progress_renderer_start(&ctx.renderer, &ctx.progress, 1, 10);
+    }
+    ctx.transfer.opts = opts;
+    git_remote_init_callbacks(&ctx.callbacks, GIT_REMOTE_CALLBACKS_VERSION);
+    ctx.callbacks.update_tips = &update_cb;
+    ctx.callbacks.sideband_progress = &timing_message_cb;
+    ctx.callbacks.transfer_progress = &timing_progress_cb;
+    ctx.callbacks.payload = &ctx.transfer;
+    phase_done(&ctx, UPDATE_PHASE_INIT, started);
+
+    // If the last run left the current version applied, one ls-remote against a
+    // detached remote is enough to know there is nothing to do
+    git_oid remote_oid;
+    int probed = 0;
+    int error = 0;
+    if (have_state) {
+        printf("Checking for updates\n");
+        git_remote *remote = NULL;
+        started = monotonic_seconds();
+        int created = git_remote_create_detached(&remote, remote_url) == 0;
+        phase_done(&ctx, UPDATE_PHASE_REMOTE_CREATE, started);
+        started = monotonic_seconds();
+        error = created ? remote_head_oid(&remote_oid, remote, &ctx.callbacks, ctx.channel.remote_ref) : -1;
+        probed = error == 0;
+        phase_done(&ctx, UPDATE_PHASE_CONNECT, started);
+        git_remote_free(remote);
+
+        // Offline, the fetch would only wait out the same connect timeout again
+        if (!probed) {
+            handle_git_error(error);
+            printf("Could not reach the update server\n");
+            ctx.timings->result = "failed";
+            goto done;
+        }
+
+        if (git_oid_equal(&remote_oid, &state.applied)) {
+            printf("Already up to date\n");
+            record_update_state(target_path, remote_url, &state.applied, &remote_oid);
+            ctx.timings->result = "up_to_date";
+            goto done;
+        }
+        if (git_oid_equal(&remote_oid, &state.rejected)) {
+            printf("This release was rolled back, staying on the current version\n");
+            record_update_state(target_path, remote_url, &state.applied, &state.applied);
+            ctx.timings->result = "rejected";
+            goto done;
+        }
+    }
+
+    {
+        DIR* dir = opendir(ctx.repo_path);
+        if (dir) {
+            closedir(dir);
+            error = update_existing(&ctx, probed, &remote_oid);
+        } else {
+            error = install_fresh(&ctx);
+        }
+    }
+
+done:
+    if (ctx.transfer.renderer) {
+        progress_renderer_stop(&ctx.renderer);
+    }
+    // Shut down libgit2
+    git_pathspec_free(ctx.plan.exclude);
+    git_libgit2_shutdown();
+
+    return error;
+}
+
+// Downloads the update in a child process so the caller can launch the installed version right away
+// Returns the child's pid, or 0 if the update had to run in this process instead
+inline pid_t update_in_background(const char* remote_url, const char* target_path, const update_options* opts)
+{
+    update_options background_opts = UPDATE_OPTIONS_INIT;
+    if (opts) {
+        background_opts = *opts;
+    }
+    background_opts.fetch_only = 1;
+    // The client is running by now, it gets the CPU and disk first
+    background_opts.low_priority = 1;
+
+    // Don't let the child repeat anything still buffered
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(update_from_repo(remote_url, target_path, &background_opts) == 0 ? 0 : 1);
+    }
+    if (pid < 0) {
+        printf("Could not start background update, updating now\n");
+        update_from_repo(remote_url, target_path, opts);
+        return 0;
+    }
+    return pid;
+}
+
+// Repacks the install and its shared store in an idle priority child, for after an update the
+// client had to wait for. Returns the child's pid, or 0 if it could not be started
+inline pid_t maintain_in_background(const char* target_path, const update_options* opts)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid > 0 ? pid : 0;
+    }
+
+    lower_priority();
+    char repo_path[PATH_MAX];
+    snprintf(repo_path, sizeof(repo_path), opts->staged ? "%s.git" : "%s", target_path);
+    git_repository *repo = NULL;
+    odb_stats stats;
+    int error = 0;
+    git_libgit2_init();
+    if (git_repository_open(&repo, repo_path) == 0) {
+        error = maintain_repository(repo, NULL, opts, &stats, 1);
+        git_repository_free(repo);
+        repo = NULL;
+    }
+    if (error == 0 && opts->shared_objects && git_repository_open_bare(&repo, opts->shared_objects) == 0) {
+        error = maintain_repository(repo, NULL, opts, &stats, 1);
+        git_repository_free(repo);
+    }
+    if (error < 0) {
+        handle_git_error(error);
+    }
+    git_libgit2_shutdown();
+    _exit(error == 0 ? 0 : 1);
+}
+
+typedef struct prewarm_job {
+    char** paths;
+    size_t count;
+    size_t capacity;
+    size_t next;
+} prewarm_job;
+
+// Adds path, or every file below it when it is a directory
+inline void prewarm_collect(prewarm_job* job, const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(path);
+        if (!dir) {
+            return;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char child[PATH_MAX];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            prewarm_collect(job, child);
+        }
+        closedir(dir);
+        return;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        return;
+    }
+    if (job->count == job->capacity) {
+        job->capacity = job->capacity ? job->capacity * 2 : 64;
+        job->paths = (char**)realloc(job->paths, job->capacity * sizeof(char*));
+    }
+    job->paths[job->count++] = strdup(path);
+}
+
+inline void prewarm_file(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+#ifdef __linux__
+    // Queues the whole file for readahead and returns, the reads finish after the client starts
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#else
+    // Without an asynchronous hint, reading the file through is what brings it into the cache
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+#endif
+    close(fd);
+}
+
+inline void* prewarm_worker(void* payload)
+{
+    prewarm_job* job = (prewarm_job*)payload;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) {
+            break;
+        }
+        prewarm_file(job->paths[i]);
+    }
+    return NULL;
+}
+
+// Asks the OS to pull the client's files into the page cache so its first launch doesn't wait
+// on a cold disk. paths are relative to target_path and may name directories, which are taken
+// whole. Missing paths are skipped, this only ever makes the launch faster
+inline void prewarm_files(const char* target_path, const char* const* paths, size_t count, int threads)
+{
+    prewarm_job job = {NULL, 0, 0, 0};
+    for (size_t i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", target_path, paths[i]);
+        prewarm_collect(&job, path);
+    }
+
+    // fadvise can still block on reading the file's extent map, so the files are spread over threads
+    pthread_t workers[64];
+    if (threads > 64) {
+        threads = 64;
+    }
+    int started = 0;
+    while (started < threads && (size_t)started < job.count &&
+           pthread_create(&workers[started], NULL, prewarm_worker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        prewarm_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (size_t i = 0; i < job.count; i++) {
+        free(job.paths[i]);
+    }
+    free(job.paths);
+}
+
+#ifdef WIN32
+inline int start_process(PROCESS_INFORMATION* process, const char* path, const char* const* args, size_t count)
+{
+    char command_line[32768];
+    size_t len = (size_t)snprintf(command_line, sizeof(command_line), "\"%s\"", path);
+    for (size_t i = 0; i < count && len < sizeof(command_line); i++) {
+        len += (size_t)snprintf(command_line + len, sizeof(command_line) - len, " \"%s\"", args[i]);
+    }
+    if (len >= sizeof(command_line)) {
+        git_error_set_str(GIT_ERROR_INVALID, "command line is too long");
+        return -1;
+    }
+    STARTUPINFOA startup;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    if (!CreateProcessA(path, command_line, NULL, NULL, FALSE, 0, NULL, NULL, &startup, process)) {
+        git_error_set_str(GIT_ERROR_OS, "could not start the client");
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+// Replaces the launcher with the client at path, passing it args, which ends with NULL.
+// Nothing of the updater stays resident and no shell is started. Only returns on failure
+inline int launch_app(const char* path, const char* const* args)
+{
+    size_t count = 0;
+    while (args && args[count]) {
+        count++;
+    }
+    // Anything still buffered would be lost with this process image
+    fflush(stdout);
+
+#ifdef WIN32
+    // Windows has no exec, so start the client and exit
+    PROCESS_INFORMATION process;
+    if (start_process(&process, path, args, count) < 0) {
+        return -1;
+    }
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    exit(0);
+#else
+    char** argv = (char**)malloc((count + 2) * sizeof(char*));
+    argv[0] = (char*)path;
+    for (size_t i = 0; i < count; i++) {
+        argv[i + 1] = (char*)args[i];
+    }
+    argv[count + 1] = NULL;
+    execv(path, argv);
+    free(argv);
+    return os_error(path);
+#endif
+}
+
+// Switches a staged install back to the version its last update replaced. That version is still
+// checked out beside the active one, so this is a single rename, with no network and no checkout.
+// The release rolled back from is remembered and never applied again
+inline int rollback_version(const char* target_path)
+{
+    update_state state;
+    if (read_update_state(&state, target_path) < 0 || git_oid_is_zero(&state.previous)) {
+        git_error_set_str(GIT_ERROR_INVALID, "there is no previous version to roll back to");
+        return GIT_ENOTFOUND;
+    }
+    char hex[GIT_OID_SHA1_HEXSIZE+1], version[PATH_MAX];
+    git_oid_tostr(hex, sizeof(hex), &state.previous);
+    snprintf(version, sizeof(version), "%s.versions/%s", target_path, hex);
+    if (access(version, F_OK) != 0) {
+        git_error_set_str(GIT_ERROR_INVALID, "the previous version is no longer on disk");
+        return GIT_ENOTFOUND;
+    }
+
+    int error = switch_version(target_path, &state.previous);
+    if (error < 0) {
+        return error;
+    }
+    git_oid_cpy(&state.rejected, &state.applied);
+    git_oid_cpy(&state.applied, &state.previous);
+    git_oid_cpy(&state.remote_head, &state.previous);
+    memset(&state.previous, 0, sizeof(state.previous));
+    state.early_exits = 0;
+    error = write_update_state(&state, target_path);
+
+    // Move the branch back too, so the next update starts from what is on disk
+    char repo_path[PATH_MAX];
+    snprintf(repo_path, sizeof(repo_path), "%s.git", target_path);
+    git_repository *repo = NULL;
+    git_reference *ref = NULL;
+    git_libgit2_init();
+    if (error == 0) {
+        error = git_repository_open(&repo, repo_path);
+    }
+    if (error == 0) {
+        error = git_reference_create(&ref, repo, "refs/heads/main", &state.applied, 1, "launchpad: roll back");
+    }
+    git_reference_free(ref);
+    git_repository_free(repo);
+    git_libgit2_shutdown();
+    return error;
+}
+
+// Adds an early exit to the applied version's record, or clears the record when reset is set.
+// Returns how many early exits there have been in a row
+inline int record_early_exit(const char* target_path, int reset)
+{
+    update_state state;
+    if (read_update_state(&state, target_path) < 0) {
+        return 0;
+    }
+    if (reset && state.early_exits == 0) {
+        return 0;
+    }
+    state.early_exits = reset ? 0 : state.early_exits + 1;
+    write_update_state(&state, target_path);
+    return state.early_exits;
+}
+
+// Runs the client at path to completion. Returns its exit status, 128 plus the signal
+// number if it was killed, or -1 if it could not be started
+inline int run_app(const char* path, const char* const* args)
+{
+    size_t count = 0;
+    while (args && args[count]) {
+        count++;
+    }
+    fflush(stdout);
+
+#ifdef WIN32
+    PROCESS_INFORMATION process;
+    if (start_process(&process, path, args, count) < 0) {
+        return -1;
+    }
+    DWORD code = 1;
+    WaitForSingleObject(process.hProcess, INFINITE);
+    GetExitCodeProcess(process.hProcess, &code);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    return (int)code;
+#else
+    char** argv = (char**)malloc((count + 2) * sizeof(char*));
+    argv[0] = (char*)path;
+    for (size_t i = 0; i < count; i++) {
+        argv[i + 1] = (char*)args[i];
+    }
+    argv[count + 1] = NULL;
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(path, argv);
+        _exit(127);
+    }
+    free(argv);
+    if (pid < 0) {
+        return os_error("fork");
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return os_error("waitpid");
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+#endif
+}
+
+// Launches the client like launch_app but stays to watch it. A start that fails within
+// opts->early_exit_seconds is counted in <target_path>.state and the client is started again.
+// Once opts->max_early_exits have failed in a row, a staged install rolls back to its previous
+// version, which then gets the same number of tries. Returns the client's last exit status,
+// or -1 if it could not be started
+inline int launch_supervised(const char* path, const char* const* args, const char* target_path, const update_options* opts)
+{
+    update_options default_opts = UPDATE_OPTIONS_INIT;
+    if (!opts) {
+        opts = &default_opts;
+    }
+    int window = opts->early_exit_seconds > 0 ? opts->early_exit_seconds : 30;
+    int max_exits = opts->max_early_exits > 0 ? opts->max_early_exits : 3;
+    // Counted here as well, so a state file that can't be read or written still ends the retries
+    int exits_here = 0;
+
+    for (;;) {
+        double started = monotonic_seconds();
+        int status = run_app(path, args);
+        double ran = monotonic_seconds() - started;
+        // A clean exit is the user closing the client, however soon
+        if (status <= 0 || ran >= window) {
+            record_early_exit(target_path, 1);
+            return status;
+        }
+
+        int exits = record_early_exit(target_path, 0);
+        if (++exits_here > exits) {
+            exits = exits_here;
+        }
+        printf("Client exited with status %d after %.1f seconds\n", status, ran);
+        if (exits < max_exits) {
+            continue;
+        }
+        if (!opts->staged) {
+            return status;
+        }
+        // Initialised around the rollback so its errors last until they are printed
+        git_libgit2_init();
+        int rolled_back = rollback_version(target_path) == 0;
+        update_state state;
+        if (!rolled_back) {
+            handle_git_error(-1);
+        } else if (opts->shared_objects && read_update_state(&state, target_path) == 0 &&
+                   retain_shared_version(opts->shared_objects, target_path, &state.applied) < 0) {
+            handle_git_error(-1);
+        }
+        git_libgit2_shutdown();
+        if (!rolled_back) {
+            return status;
+        }
+        printf("Rolled back to the previous version\n");
+        exits_here = 0;
+    }
+}
+
+// One repository for update_from_repos, result is filled in with update_from_repo's return value
+typedef struct update_target {
+    const char* remote_url;
+    const char* target_path;
+    const update_options* opts;
+    int result;
+} update_target;
+
+typedef struct batch_job {
+    update_target* targets;
+    size_t count;
+    size_t next;
+    update_progress* progress;
+} batch_job;
+
+typedef struct batch_slot {
+    batch_job* job;
+    size_t index;
+} batch_slot;
+
+// Counts each repository's transfer in its own slot, update_from_repos prints the sum
+inline int batch_progress_cb(const git_indexer_progress *stats, void *payload)
+{
+    batch_slot* slot = (batch_slot*)payload;
+    return update_progress_cb(stats, &slot->job->progress[slot->index]);
+}
+
+// Several servers talking at once would only garble the line
+inline int batch_message_cb(const char *str, int len, void *payload)
+{
+    (void)str; (void)len; (void)payload;
+    return 0;
+}
+
+inline void* batch_worker(void* payload)
+{
+    batch_job* job = (batch_job*)payload;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) {
+            break;
+        }
+        update_target* target = &job->targets[i];
+
+        update_options opts = UPDATE_OPTIONS_INIT;
+        if (target->opts) {
+            opts = *target->opts;
+        }
+        batch_slot slot = {job, i};
+        opts.transfer_progress = &batch_progress_cb;
+        opts.remote_message = &batch_message_cb;
+        opts.progress_payload = &slot;
+        opts.in_batch = 1;
+        target->result = update_from_repo(target->remote_url, target->target_path, &opts);
+    }
+    return NULL;
+}
+
+// The smaller of two limits, where 0 means unlimited
+inline size_t tighter_limit(size_t a, size_t b)
+{
+    return a == 0 || (b > 0 && b < a) ? b : a;
+}
+
+// Updates several repositories, such as the app, its plugins and content packs, with up to
+// max_parallel running at once, so the total takes about as long as the slowest one.
+// Returns how many failed, each target's result says which
+inline size_t update_from_repos(update_target* targets, size_t count, int max_parallel)
+{
+    // Held for the whole batch, so each update's own init and shutdown only touch a refcount
+    git_libgit2_init();
+
+    // Set once before the updates start, changing them while others run would race with their
+    // fetches. The tightest memory limit any target asks for holds for all of them, and with
+    // mirrors in use every connection in the batch gets the mirrors' short connect timeout
+    update_options limits = UPDATE_OPTIONS_INIT;
+    int mirrors = 0;
+    for (size_t i = 0; i < count; i++) {
+        const update_options* opts = targets[i].opts;
+        if (opts) {
+            limits.mwindow_size = tighter_limit(limits.mwindow_size, opts->mwindow_size);
+            limits.mwindow_mapped_limit = tighter_limit(limits.mwindow_mapped_limit, opts->mwindow_mapped_limit);
+            limits.cache_max_size = tighter_limit(limits.cache_max_size, opts->cache_max_size);
+            mirrors |= opts->mirror_url_count > 0;
+        }
+    }
+    if (apply_memory_limits(&limits) < 0) {
+        handle_git_error(-1);
+    }
+    if (mirrors) {
+        set_mirror_connect_timeout(1);
+    }
+
+    batch_job job;
+    job.targets = targets;
+    job.count = count;
+    job.next = 0;
+    job.progress = (update_progress*)calloc(count ? count : 1, sizeof(update_progress));
+    progress_renderer renderer;
+    progress_renderer_start(&renderer, job.progress, count, 10);
+
+    pthread_t workers[64];
+    int started = 0;
+    if (max_parallel > 64) {
+        max_parallel = 64;
+    }
+    while ((size_t)started < count && started < max_parallel &&
+           pthread_create(&workers[started], NULL, batch_worker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        batch_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    progress_renderer_stop(&renderer);
+    free(job.progress);
+    if (mirrors) {
+        set_mirror_connect_timeout(0);
+    }
+    git_libgit2_shutdown();
+
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        failed += targets[i].result != 0;
+    }
+    return failed;
+}
+
+// What an update started with update_start reports, one event at a time
+typedef enum update_event_type {
+    // phase is an update_phase that just ended, after seconds
+    UPDATE_EVENT_PHASE,
+    // progress holds the latest transfer counts
+    UPDATE_EVENT_TRANSFER,
+    // message holds a line of the server's progress output
+    UPDATE_EVENT_MESSAGE,
+    // Always last: error is what update_from_repo returned and result is update_timings' result
+    UPDATE_EVENT_DONE
+} update_event_type;
+
+typedef struct update_event {
+    update_event_type type;
+    int phase;
+    double seconds;
+    git_indexer_progress progress;
+    char message[256];
+    int error;
+    const char* result;
+} update_event;
+
+// An update running on its own thread. The strings in the options it was started with are
+// borrowed, they have to stay valid until update_finish
+typedef struct update_handle {
+    char remote_url[1024];
+    char target_path[PATH_MAX];
+    update_options opts;
+    update_timings timings;
+    int cancel;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    // A ring of pending events. Transfer events replace a transfer event still waiting at the back,
+    // so a caller polling once a frame never falls behind a fast download
+    update_event events[64];
+    size_t first;
+    size_t count;
+    int done;
+    int done_delivered;
+    int error;
+} update_handle;
+
+inline void update_handle_push(update_handle* handle, const update_event* event)
+{
+    pthread_mutex_lock(&handle->lock);
+    size_t capacity = sizeof(handle->events) / sizeof(handle->events[0]);
+    size_t last = (handle->first + handle->count + capacity - 1) % capacity;
+    if (handle->count > 0 && event->type == UPDATE_EVENT_TRANSFER && handle->events[last].type == UPDATE_EVENT_TRANSFER) {
+        handle->events[last] = *event;
+    } else if (handle->count < capacity) {
+        handle->events[(handle->first + handle->count) % capacity] = *event;
+        handle->count++;
+    } else {
+        // Nobody is reading, the newest event is the one worth keeping
+        handle->events[last] = *event;
+    }
+    pthread_cond_broadcast(&handle->changed);
+    pthread_mutex_unlock(&handle->lock);
+}
+
+inline int update_handle_transfer_cb(const git_indexer_progress *stats, void *payload)
+{
+    update_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = UPDATE_EVENT_TRANSFER;
+    event.progress = *stats;
+    update_handle_push((update_handle*)payload, &event);
+    return 0;
+}
+
+inline int update_handle_message_cb(const char *str, int len, void *payload)
+{
+    update_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = UPDATE_EVENT_MESSAGE;
+    snprintf(event.message, sizeof(event.message), "%.*s", len, str);
+    update_handle_push((update_handle*)payload, &event);
+    return 0;
+}
+
+inline void update_handle_phase_cb(int phase, double seconds, void* payload)
+{
+    update_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = UPDATE_EVENT_PHASE;
+    event.phase = phase;
+    event.seconds = seconds;
+    update_handle_push((update_handle*)payload, &event);
+}
+
+inline void* update_handle_worker(void* payload)
+{
+    update_handle* handle = (update_handle*)payload;
+    int error = update_from_repo(handle->remote_url, handle->target_path, &handle->opts);
+
+    pthread_mutex_lock(&handle->lock);
+    handle->error = error;
+    handle->done = 1;
+    pthread_cond_broadcast(&handle->changed);
+    pthread_mutex_unlock(&handle->lock);
+    return NULL;
+}
+
+// Starts update_from_repo on a new thread. Progress arrives as events through update_poll
+// or update_wait instead of being printed. Returns NULL if the thread could not be started
+inline update_handle* update_start(const char* remote_url, const char* target_path, const update_options* opts)
+{
+    update_handle* handle = (update_handle*)calloc(1, sizeof(update_handle));
+    if (!handle) {
+        return NULL;
+    }
+    snprintf(handle->remote_url, sizeof(handle->remote_url), "%s", remote_url);
+    snprintf(handle->target_path, sizeof(handle->target_path), "%s", target_path);
+    if (opts) {
+        handle->opts = *opts;
+    }
+    if (!handle->opts.timings) {
+        handle->opts.timings = &handle->timings;
+    }
+    handle->opts.transfer_progress = &update_handle_transfer_cb;
+    handle->opts.remote_message = &update_handle_message_cb;
+    handle->opts.phase_done = &update_handle_phase_cb;
+    handle->opts.progress_payload = handle;
+    handle->opts.cancel = &handle->cancel;
+    pthread_mutex_init(&handle->lock, NULL);
+    pthread_cond_init(&handle->changed, NULL);
+
+    if (pthread_create(&handle->thread, NULL, update_handle_worker, handle) != 0) {
+        pthread_cond_destroy(&handle->changed);
+        pthread_mutex_destroy(&handle->lock);
+        free(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+// Takes the next event while holding the lock, returns 0 if there is none yet
+inline int update_handle_pop(update_handle* handle, update_event* out)
+{
+    size_t capacity = sizeof(handle->events) / sizeof(handle->events[0]);
+    if (handle->count > 0) {
+        *out = handle->events[handle->first];
+        handle->first = (handle->first + 1) % capacity;
+        handle->count--;
+        return 1;
+    }
+    if (handle->done && !handle->done_delivered) {
+        memset(out, 0, sizeof(*out));
+        out->type = UPDATE_EVENT_DONE;
+        out->error = handle->error;
+        out->result = handle->opts.timings->result ? handle->opts.timings->result : "failed";
+        handle->done_delivered = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Returns 1 and fills out with the next event if there is one, otherwise returns 0 right away
+inline int update_poll(update_handle* handle, update_event* out)
+{
+    pthread_mutex_lock(&handle->lock);
+    int found = update_handle_pop(handle, out);
+    pthread_mutex_unlock(&handle->lock);
+    return found;
+}
+
+// Like update_poll, but waits up to timeout_ms for an event, or for as long as it takes if negative
+inline int update_wait(update_handle* handle, update_event* out, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout_ms > 0) {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&handle->lock);
+    int found = update_handle_pop(handle, out);
+    while (!found && !handle->done_delivered) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&handle->changed, &handle->lock);
+        } else if (timeout_ms == 0 || pthread_cond_timedwait(&handle->changed, &handle->lock, &deadline) != 0) {
+            break;
+        }
+        found = update_handle_pop(handle, out);
+    }
+    pthread_mutex_unlock(&handle->lock);
+    return found;
+}
+
+// Asks the update to stop. Transfers stop at their next progress report, within a tenth of a
+// second for downloads, and checkouts on the plan's workers at their next file. A libgit2
+// checkout that has started writing finishes first. Then UPDATE_EVENT_DONE comes with GIT_EUSER.
+// A finished download or switched version stays as it is
+inline void update_cancel(update_handle* handle)
+{
+    __atomic_store_n(&handle->cancel, 1, __ATOMIC_RELAXED);
+}
+
+// Waits for the update to end, frees the handle and returns what update_from_repo returned
+inline int update_finish(update_handle* handle)
+{
+    pthread_join(handle->thread, NULL);
+    int error = handle->error;
+    pthread_cond_destroy(&handle->changed);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+    return error;
+}
+
+// The socket a daemon for target_path listens on, <target_path>.sock
+inline int update_socket_address(struct sockaddr_un* out, const char* target_path)
+{
+    memset(out, 0, sizeof(*out));
+    out->sun_family = AF_UNIX;
+    if ((size_t)snprintf(out->sun_path, sizeof(out->sun_path), "%s.sock", target_path) >= sizeof(out->sun_path)) {
+        git_error_set_str(GIT_ERROR_INVALID, "socket path is too long");
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct update_daemon {
+    const char* remote_url;
+    const char* target_path;
+    update_options opts;
+    int interval;
+    int busy;
+} update_daemon;
+
+// Checks for a release every interval seconds and downloads it, staging it if opts asks for staged updates
+inline void* update_daemon_worker(void* payload)
+{
+    update_daemon* daemon = (update_daemon*)payload;
+    unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    for (;;) {
+        __atomic_store_n(&daemon->busy, 1, __ATOMIC_RELAXED);
+        update_from_repo(daemon->remote_url, daemon->target_path, &daemon->opts);
+        __atomic_store_n(&daemon->busy, 0, __ATOMIC_RELAXED);
+
+        int delay = daemon->interval;
+        if (daemon->opts.check_jitter > 0) {
+            delay += rand_r(&seed) % (daemon->opts.check_jitter + 1);
+        }
+        sleep((unsigned int)delay);
+    }
+    return NULL;
+}
+
+// Answers one request with "busy", "current <oid>" or "ready <oid>", where ready
+// means an update has been downloaded and apply_ready_version can switch to it
+inline void update_daemon_reply(update_daemon* daemon, int fd)
+{
+    char request[64], reply[64], hex[GIT_OID_SHA1_HEXSIZE+1];
+    update_state state;
+    // Requests are answered one at a time, a client that connects and never writes must not
+    // stop the daemon answering everyone else
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (read(fd, request, sizeof(request)) < 0) {
+        return;
+    }
+
+    if (__atomic_load_n(&daemon->busy, __ATOMIC_RELAXED) || read_update_state(&state, daemon->target_path) < 0) {
+        snprintf(reply, sizeof(reply), "busy\n");
+    } else if (git_oid_equal(&state.applied, &state.remote_head)) {
+        git_oid_tostr(hex, sizeof(hex), &state.applied);
+        snprintf(reply, sizeof(reply), "current %s\n", hex);
+    } else {
+        git_oid_tostr(hex, sizeof(hex), &state.remote_head);
+        snprintf(reply, sizeof(reply), "ready %s\n", hex);
+    }
+    if (write(fd, reply, strlen(reply)) < 0) {
+        return;
+    }
+}
+
+// Runs for good: keeps libgit2 and its transports loaded, downloads each release as soon as it
+// is out, and answers launches on <target_path>.sock so they never have to touch the network.
+// Only returns if the socket could not be set up, after printing why
+inline int run_update_daemon(const char* remote_url, const char* target_path, const update_options* opts, int interval)
+{
+    update_daemon daemon;
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.remote_url = remote_url;
+    daemon.target_path = target_path;
+    if (opts) {
+        daemon.opts = *opts;
+    }
+    daemon.opts.fetch_only = 1;
+    daemon.opts.low_priority = 1;
+    daemon.opts.check_interval = 0;
+    daemon.interval = interval > 0 ? interval : 300;
+
+    // Held for the daemon's lifetime, so each check's own init and shutdown only touch a refcount.
+    // It also keeps the setup errors below around until they are printed
+    git_libgit2_init();
+    struct sockaddr_un address;
+    pthread_t worker;
+    int listener = -1;
+    int error = update_socket_address(&address, target_path);
+    if (error == 0) {
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            error = os_error("socket");
+        }
+    }
+    // A socket no one answers on was left behind by a daemon that died
+    if (error == 0 && connect(listener, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        git_error_set_str(GIT_ERROR_INVALID, "an update daemon is already running");
+        error = -1;
+    }
+    if (listener >= 0) {
+        close(listener);
+        listener = -1;
+    }
+    if (error == 0) {
+        unlink(address.sun_path);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+            error = os_error(address.sun_path);
+        }
+    }
+    if (error == 0 && pthread_create(&worker, NULL, update_daemon_worker, &daemon) != 0) {
+        error = os_error("pthread_create");
+    }
+    if (error < 0) {
+        if (listener >= 0) {
+            close(listener);
+        }
+        handle_git_error(error);
+        git_libgit2_shutdown();
+        return error;
+    }
+
+    printf("Update daemon listening on %s\n", address.sun_path);
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd >= 0) {
+            update_daemon_reply(&daemon, fd);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+inline int ask_update_daemon(const char* target_path, git_oid* out)
+{
+    struct sockaddr_un address;
+    if (update_socket_address(&address, target_path) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return os_error("socket");
+    }
+    // A daemon that stops answering must not hold up the launch
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return os_error(address.sun_path);
+    }
+
+    char reply[64];
+    ssize_t len = -1;
+    if (write(fd, "status\n", 7) == 7) {
+        len = read(fd, reply, sizeof(reply) - 1);
+    }
+    close(fd);
+    if (len <= 0) {
+        return os_error(address.sun_path);
+    }
+    reply[len] = '\0';
+    if (strncmp(reply, "ready ", 6) == 0 && git_oid_fromstrn(out, reply + 6, GIT_OID_SHA1_HEXSIZE) == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+// Asks the daemon for target_path whether an update is waiting. Returns 1 and fills out
+// if an update is ready, 0 if the installed version is current or the daemon is busy,
+// and -1 without a daemon to ask. Launches without a daemon are the usual case, so
+// nothing is printed for them
+inline int query_update_daemon(const char* target_path, git_oid* out)
+{
+    git_libgit2_init();
+    int result = ask_update_daemon(target_path, out);
+    git_libgit2_shutdown();
+    return result;
+}
+
+// Applies the update a fetch_only run downloaded, from local objects alone, and prints why if it can't
+inline int apply_ready_version(const char* target_path, const update_options* opts)
+{
+    update_options default_opts = UPDATE_OPTIONS_INIT;
+    if (!opts) {
+        opts = &default_opts;
+    }
+    update_state state;
+    int error = read_update_state(&state, target_path);
+    if (error < 0 || git_oid_equal(&state.applied, &state.remote_head) || git_oid_equal(&state.remote_head, &state.rejected)) {
+        return error;
+    }
+
+    char repo_path[PATH_MAX];
+    snprintf(repo_path, sizeof(repo_path), opts->staged ? "%s.git" : "%s", target_path);
+    git_repository *repo = NULL;
+    checkout_plan plan;
+    git_libgit2_init();
+    error = plan_init(&plan, opts);
+    if (error == 0) {
+        error = git_repository_open(&repo, repo_path);
+    }
+    if (error == 0) {
+        printf("Applying update\n");
+        if (opts->staged) {
+            error = apply_staged(repo, &state.remote_head, target_path, &plan);
+        } else {
+            error = apply_changed_paths(repo, &state.remote_head, &plan);
+        }
+    }
+    if (error == 0) {
+        record_update_state(target_path, state.remote_url, &state.remote_head, &state.remote_head);
+        if (opts->shared_objects && retain_shared_version(opts->shared_objects, target_path, &state.remote_head) < 0) {
+            handle_git_error(-1);
+        }
+    }
+
+    // Reported here, the error is gone once libgit2 is shut down
+    if (error < 0) {
+        handle_git_error(error);
+    }
+    git_repository_free(repo);
+    git_pathspec_free(plan.exclude);
+    git_libgit2_shutdown();
+    return error;
+}
+
+// What a file looked like the last time its content was confirmed, so it isn't hashed again until it changes
+typedef struct manifest_entry {
+    char* path;
+    long long mtime;
+    long long mtime_nsec;
+    long long size;
+    git_oid oid;
+} manifest_entry;
+
+typedef struct manifest {
+    manifest_entry* entries;
+    size_t count;
+} manifest;
+
+inline int manifest_entry_cmp(const void* a, const void* b)
+{
+    return strcmp(((const manifest_entry*)a)->path, ((const manifest_entry*)b)->path);
+}
+
+inline void manifest_free(manifest* list)
+{
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].path);
+    }
+    free(list->entries);
+    list->entries = NULL;
+    list->count = 0;
+}
+
+// Reads <target_path>.manifest, one "<mtime> <nsec> <size> <oid> <path>" line per file.
+// A missing or unreadable manifest is an empty one, every file just gets hashed
+inline void read_manifest(manifest* out, const char* target_path)
+{
+    char path[PATH_MAX], line[PATH_MAX + 128], hex[GIT_OID_SHA1_HEXSIZE+1];
+    size_t capacity = 0;
+    memset(out, 0, sizeof(*out));
+    snprintf(path, sizeof(path), "%s.manifest", target_path);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        manifest_entry entry;
+        int offset = 0;
+        if (sscanf(line, "%lld %lld %lld %40s %n", &entry.mtime, &entry.mtime_nsec, &entry.size, hex, &offset) < 4 ||
+            offset == 0 || git_oid_fromstr(&entry.oid, hex) < 0) {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        entry.path = strdup(line + offset);
+        if (out->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            out->entries = (manifest_entry*)realloc(out->entries, capacity * sizeof(manifest_entry));
+        }
+        out->entries[out->count++] = entry;
+    }
+    fclose(file);
+    qsort(out->entries, out->count, sizeof(manifest_entry), manifest_entry_cmp);
+}
+
+inline const manifest_entry* manifest_find(const manifest* list, const char* path)
+{
+    manifest_entry key;
+    key.path = (char*)path;
+    return (const manifest_entry*)bsearch(&key, list->entries, list->count, sizeof(manifest_entry), manifest_entry_cmp);
+}
+
+// How one file of the tree compared, filled in by the verify workers
+typedef struct verify_result {
+    int matches;
+    struct stat st;
+} verify_result;
+
+typedef struct verify_job {
+    const char* workdir;
+    const blob_list* blobs;
+    const manifest* cached;
+    verify_result* results;
+    size_t next;
+    size_t hashed;
+} verify_job;
+
+// Compares a file to its blob: by the manifest when its stat data hasn't changed, by hash otherwise
+inline int verify_file(const char* workdir, const blob_entry* blob, const manifest* cached, verify_result* result, size_t* hashed)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", workdir, blob->path);
+    if (lstat(path, &result->st) != 0) {
+        return 0;
+    }
+    if (blob->mode == GIT_FILEMODE_LINK) {
+        if (!S_ISLNK(result->st.st_mode)) {
+            return 0;
+        }
+    } else if (!S_ISREG(result->st.st_mode) ||
+               (blob->mode == GIT_FILEMODE_BLOB_EXECUTABLE) != ((result->st.st_mode & S_IXUSR) != 0)) {
+        return 0;
+    }
+
+    const manifest_entry* entry = manifest_find(cached, blob->path);
+    if (entry && git_oid_equal(&entry->oid, &blob->oid) && entry->size == (long long)result->st.st_size &&
+        entry->mtime == (long long)result->st.st_mtim.tv_sec && entry->mtime_nsec == (long long)result->st.st_mtim.tv_nsec) {
+        return 1;
+    }
+
+    git_oid oid;
+    __atomic_fetch_add(hashed, 1, __ATOMIC_RELAXED);
+    if (S_ISLNK(result->st.st_mode)) {
+        char link_target[PATH_MAX];
+        ssize_t len = readlink(path, link_target, sizeof(link_target));
+        if (len < 0 || git_odb_hash(&oid, link_target, (size_t)len, GIT_OBJECT_BLOB) < 0) {
+            return 0;
+        }
+    } else if (git_odb_hashfile(&oid, path, GIT_OBJECT_BLOB) < 0) {
+        return 0;
+    }
+    return git_oid_equal(&oid, &blob->oid);
+}
+
+inline void* verify_worker(void* payload)
+{
+    verify_job* job = (verify_job*)payload;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->blobs->count) {
+            break;
+        }
+        job->results[i].matches = verify_file(job->workdir, &job->blobs->entries[i], job->cached, &job->results[i], &job->hashed);
+    }
+    return NULL;
+}
+
+// Rewrites <target_path>.manifest from what was just confirmed. Files modified within the last
+// second are left out, a change in the same timestamp granule would otherwise go unnoticed
+inline int write_manifest(const char* target_path, const blob_list* blobs, const verify_result* results)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX], hex[GIT_OID_SHA1_HEXSIZE+1];
+    snprintf(path, sizeof(path), "%s.manifest", target_path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.manifest.tmp", target_path);
+    FILE* file = fopen(tmp_path, "w");
+    if (!file) {
+        return os_error(tmp_path);
+    }
+    time_t recent = time(NULL) - 1;
+    for (size_t i = 0; i < blobs->count; i++) {
+        if (!results[i].matches || results[i].st.st_mtime >= recent) {
+            continue;
+        }
+        git_oid_tostr(hex, sizeof(hex), &blobs->entries[i].oid);
+        fprintf(file, "%lld %lld %lld %s %s\n", (long long)results[i].st.st_mtim.tv_sec, (long long)results[i].st.st_mtim.tv_nsec,
+                (long long)results[i].st.st_size, hex, blobs->entries[i].path);
+    }
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        return os_error(path);
+    }
+    return 0;
+}
+
+// Checks every file of the installed version against its blob and rewrites only the ones that
+// differ or are missing. The manifest beside target_path spares hashing files whose size and
+// mtime haven't changed since they were last confirmed. Returns how many files were repaired
+inline int verify_install(const char* target_path, const update_options* opts)
+{
+    update_options default_opts = UPDATE_OPTIONS_INIT;
+    if (!opts) {
+        opts = &default_opts;
+    }
+    char repo_path[PATH_MAX];
+    snprintf(repo_path, sizeof(repo_path), opts->staged ? "%s.git" : "%s", target_path);
+
+    git_repository *repo = NULL;
+    git_commit *head = NULL;
+    git_tree *tree = NULL;
+    git_oid head_oid;
+    blob_list blobs = {NULL, 0, 0}, broken = {NULL, 0, 0};
+    manifest cached = {NULL, 0};
+    verify_result* results = NULL;
+    checkout_plan plan;
+
+    git_libgit2_init();
+    int error = plan_init(&plan, opts);
+    if (error == 0) {
+        error = git_repository_open(&repo, repo_path);
+    }
+    if (error == 0) {
+        error = git_reference_name_to_id(&head_oid, repo, "HEAD");
+    }
+    if (error == 0) {
+        error = git_commit_lookup(&head, repo, &head_oid);
+    }
+    if (error == 0) {
+        error = git_commit_tree(&tree, head);
+    }
+    if (error == 0) {
+        error = tree_blobs(&blobs, tree);
+        blob_list_exclude(&blobs, &plan);
+    }
+
+    if (error == 0) {
+        read_manifest(&cached, target_path);
+        results = (verify_result*)calloc(blobs.count ? blobs.count : 1, sizeof(verify_result));
+        verify_job job = {target_path, &blobs, &cached, results, 0, 0};
+
+        // Hashing is bound by the disk as much as the CPU, so this runs on the checkout threads
+        pthread_t workers[64];
+        int threads = plan_threads(&plan) > 64 ? 64 : plan_threads(&plan);
+        int started = 0;
+        while (started < threads && pthread_create(&workers[started], NULL, verify_worker, &job) == 0) {
+            started++;
+        }
+        if (started == 0) {
+            verify_worker(&job);
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+
+        for (size_t i = 0; i < blobs.count; i++) {
+            if (!results[i].matches) {
+                printf("Repairing %s\n", blobs.entries[i].path);
+                blob_list_push(&broken, blobs.entries[i].path, &blobs.entries[i].oid, blobs.entries[i].mode);
+            }
+        }
+        printf("Verified %zu files, hashed %zu, %zu damaged\n", blobs.count, job.hashed, broken.count);
+    }
+
+    if (error == 0 && broken.count > 0) {
+        if (opts->staged) {
+            error = materialize_blobs(repo, target_path, &broken, plan_threads(&plan), plan.cancel);
+        } else {
+            error = materialize_into_workdir(repo, &broken, plan_threads(&plan), plan.cancel);
+        }
+        // Freshly written files are confirmed by stat alone, they came straight from the blobs
+        for (size_t i = 0; error == 0 && i < blobs.count; i++) {
+            if (!results[i].matches) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", target_path, blobs.entries[i].path);
+                results[i].matches = lstat(path, &results[i].st) == 0;
+            }
+        }
+    }
+    if (error == 0) {
+        write_manifest(target_path, &blobs, results);
+    }
+
+    size_t repaired = broken.count;
+    free(results);
+    manifest_free(&cached);
+    blob_list_free(&broken);
+    blob_list_free(&blobs);
+    git_tree_free(tree);
+    git_commit_free(head);
+    git_repository_free(repo);
+    git_pathspec_free(plan.exclude);
+    git_libgit2_shutdown();
+    return error < 0 ? error : (int)repaired;
+}
@@ -2,14 +2,177 @@
 #include <stdio.h>
 
 int main(int argc, const char** argv) {
-    if (update_from_repo("git@github.com:isaiahparton/auto-updater.git", "./app") != 0)
+    // Only the current release is needed on the first install
+    update_options opts = UPDATE_OPTIONS_INIT;
+    opts.depth = 1;
+
+    // One JSON line per launch, so startup regressions show up across the fleet
+    update_timings timings;
+    memset(&timings, 0, sizeof(timings));
+    timings.started = monotonic_seconds();
+    timings.result = "background";
+    opts.timings = &timings;
+    // Writing large assets scales with cores where libgit2's checkout does not
+    opts.checkout_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    // A repository with one pack opens and searches in constant time, each update adds one
+    opts.max_packs = 8;
+    opts.max_loose_objects = 1024;
+#ifdef SPARSE_BY_PLATFORM
+    // Each platform only writes its own binaries
+#ifdef WIN32
+    static const char* other_platforms[] = {"ShopkeeperClient", "*.so"};
+#else
+    static const char* other_platforms[] = {"*.exe", "*.dll"};
+#endif
+    opts.sparse_exclude = other_platforms;
+    opts.sparse_exclude_count = sizeof(other_platforms) / sizeof(other_platforms[0]);
+#endif
+#ifdef UPDATE_CHECK_INTERVAL
+    // Relaunches inside the interval go straight to the client
+    opts.check_interval = UPDATE_CHECK_INTERVAL;
+    opts.check_jitter = UPDATE_CHECK_INTERVAL / 10;
+#endif
+#ifdef UPDATE_BUNDLE_URL
+    // First installs come from static hosting instead of the git server
+    opts.bundle_url = UPDATE_BUNDLE_URL;
+#endif
+#ifdef UPDATE_RELEASE_BUNDLES
+    // Large updates resume after a dropped connection instead of starting over
+    opts.update_bundle_url = UPDATE_RELEASE_BUNDLES;
+#endif
+#ifdef UPDATE_PATCH_URL
+    // Rebuilt binaries arrive as deltas against the installed release
+    opts.patch_url = UPDATE_PATCH_URL;
+#endif
+#ifdef SHARED_OBJECTS
+    // Every copy on the machine downloads and stores each release once
+    opts.shared_objects = SHARED_OBJECTS;
+#endif
+#ifdef UPDATE_MIRRORS
+    // Machines on the store's network that already have the release, as a comma separated list of strings
+    static const char* mirrors[] = {UPDATE_MIRRORS};
+    opts.mirror_urls = mirrors;
+    opts.mirror_url_count = sizeof(mirrors) / sizeof(mirrors[0]);
+#endif
+#ifdef UPDATE_TRUSTED_KEY
+    // Only releases signed with the release key are installed, whichever server or mirror they came from
+    static const char* trusted_keys[] = {UPDATE_TRUSTED_KEY};
+    opts.trusted_keys = trusted_keys;
+    opts.trusted_key_count = 1;
+#endif
+#ifdef UPDATE_CHANNEL
+    // A beta branch, or a tag that keeps these machines on one release
+    opts.channel = UPDATE_CHANNEL;
+#endif
+#ifdef LOW_MEMORY_DEVICE
+    // Map packs in small windows and keep the object cache small, for 1 GB of RAM
+    opts.mwindow_size = 32 * 1024 * 1024;
+    opts.mwindow_mapped_limit = 256 * 1024 * 1024;
+    opts.cache_max_size = 64 * 1024 * 1024;
+    // Workers hold a whole file each while writing it
+    opts.checkout_threads = 2;
+#endif
+#ifdef STAGED_UPDATE
+    // Never write into the directory the client runs from
+    opts.staged = 1;
+#endif
+
+#ifdef UPDATE_DAEMON
+    // launcher --daemon keeps running and downloads releases as they come out
+    if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+        run_update_daemon("git@github.com:isaiahparton/auto-updater.git", "./app", &opts, UPDATE_DAEMON);
+        return 1;
+    }
+    // With a daemon running, launches only apply what it has already downloaded
+    git_oid ready;
+    int daemon_state = query_update_daemon("./app", &ready);
+    if (daemon_state >= 0) {
+        if (daemon_state == 1) {
+            apply_ready_version("./app", &opts);
+        }
+        timings.result = daemon_state == 1 ? "updated" : "up_to_date";
+    } else {
+#endif
+#ifdef LAUNCH_BEFORE_UPDATE
+    // Start the installed version now and let the next launch pick up the update
+    DIR* dir = opendir("./app");
+    if (dir) {
+        closedir(dir);
+        // What the last launch downloaded is applied from local objects before the client starts
+        apply_ready_version("./app", &opts);
+#ifdef BACKGROUND_BYTES_PER_SECOND
+        // Leave the store's uplink to the client
+        opts.max_bytes_per_second = BACKGROUND_BYTES_PER_SECOND;
+#endif
+        update_in_background("git@github.com:isaiahparton/auto-updater.git", "./app", &opts);
+    } else
+#endif
+    if (update_from_repo("git@github.com:isaiahparton/auto-updater.git", "./app", &opts) != 0)
     {
         printf("Failed to update app, launching anyway\n");
+    } else {
+        // The client has waited for the update, it doesn't wait for the repack too
+        maintain_in_background("./app", &opts);
     }
+#ifdef UPDATE_DAEMON
+    }
+#endif
+
+    // launcher --verify also repairs files damaged since they were installed
+    int first_arg = 1;
+    if (argc > 1 && strcmp(argv[1], "--verify") == 0) {
+        first_arg = 2;
+        if (verify_install("./app", &opts) < 0) {
+            handle_git_error(-1);
+        }
+    }
+
+    timings.seconds[UPDATE_PHASE_LAUNCH] = monotonic_seconds() - timings.started;
+    // Launches are frequent and kiosk storage is small, so keep the log to 512 KB in all
+    write_update_timings(&timings, "./app.timings", 256 * 1024);
+
+#ifdef MIRROR_PORT
+    // Serve this install to the rest of the store for as long as the client runs
+#ifdef STAGED_UPDATE
+    serve_mirror("./app.git", MIRROR_PORT);
+#else
+    serve_mirror("./app", MIRROR_PORT);
+#endif
+#endif
+
+#ifdef PREWARM_ASSETS
+    // Start reading the client and the assets it needs for its first frame off the disk
+    {
 #ifdef WIN32
-    system("./app/ShopkeeperClient.exe");
+        const char* hot[] = {"ShopkeeperClient.exe", PREWARM_ASSETS};
 #else
-    system("./app/ShopkeeperClient");
+        const char* hot[] = {"ShopkeeperClient", PREWARM_ASSETS};
+#endif
+        prewarm_files("./app", hot, sizeof(hot) / sizeof(hot[0]), opts.checkout_threads);
+    }
+#endif
+
+#if defined(STAGED_UPDATE) && defined(ROLLBACK_EARLY_EXITS)
+    // Stay to watch the client, a release that keeps failing to start is rolled back
+    opts.max_early_exits = ROLLBACK_EARLY_EXITS;
+#ifdef WIN32
+    int status = launch_supervised("./app/ShopkeeperClient.exe", argv + first_arg, "./app", &opts);
+#else
+    int status = launch_supervised("./app/ShopkeeperClient", argv + first_arg, "./app", &opts);
+#endif
+    if (status < 0) {
+        handle_git_error(-1);
+        return 1;
+    }
+    return status;
+#else
+    // The client takes over this process and gets the launcher's arguments
+#ifdef WIN32
+    launch_app("./app/ShopkeeperClient.exe", argv + first_arg);
+#else
+    launch_app("./app/ShopkeeperClient", argv + first_arg);
+#endif
+    handle_git_error(-1);
+    return 1;
 #endif
-    return 0;
 }